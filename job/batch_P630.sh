@@ -15,7 +15,7 @@ echo "executable,device,parameters,time1,time2,time3,time4";
 
 device="cpu";
 
-for executable in "direct_sequential" "gemm_sequential" "blis_sequential" "im2col" "matmul"; do
+for executable in "direct_sequential" "direct_blocked8" "direct_blocked16" "gemm_sequential" "blis_sequential" "blis_threaded" "blis_int8" "im2col" "matmul"; do
   for params in\
     "8  4 4 1024 1024 3 3"\
     "16 4 4 1024 1024 3 3"\
@@ -59,7 +59,7 @@ for executable in "winograd_onednn"; do
   done;
 done;
 
-for executable in "direct_onednn" "gemm_onednn" "direct_parallel" "gemm_parallel" "blis_parallel"; do
+for executable in "direct_onednn" "gemm_onednn" "direct_parallel" "gemm_parallel" "blis_parallel" "direct_parallel_usm" "gemm_parallel_usm" "blis_parallel_usm"; do
   for device in "cpu" "gpu"; do
     for params in\
       "8  4 4 1024 1024 3 3"\
@@ -82,4 +82,24 @@ for executable in "direct_onednn" "gemm_onednn" "direct_parallel" "gemm_parallel
   done;
 done;
 
+# Pipelined USM executables: micro-batches of 8 images, double and triple
+# buffered
+for executable in "direct_parallel_usm" "gemm_parallel_usm" "blis_parallel_usm"; do
+  for options in "--micro-batch=8 --buffers=2" "--micro-batch=8 --buffers=3"; do
+    for params in\
+      "16 4 4 1024 1024 3 3"\
+      "32 4 4 1024 1024 3 3"\
+      "48 4 4 1024 1024 3 3"\
+      "64 4 4 1024 1024 3 3"\
+      "80 4 4 1024 1024 3 3"
+    do
+      printf "${executable} ${options},gpu,${params}"
+      for i in {1..4}; do
+        timei=$( { time ./${executable} gpu ${params} ${options}; } 2>&1 )
+        printf ",${timei}"
+      done; echo
+    done;
+  done;
+done;
+
 # xeon,cfl,e-2176g,ram64gb,net1gbe,gpu,gen9
\ No newline at end of file
@@ -16,8 +16,10 @@ echo "executable,device,parameters,time1,time2,time3,time4";
 device="cpu";
 
 for executable in "im2col" "matmul"\
-                  "direct_sequential" "gemm_sequential" "blis_sequential"\
-                  "direct_parallel" "gemm_parallel" "blis_parallel"\
+                  "direct_sequential" "direct_blocked8" "direct_blocked16" "gemm_sequential" "blis_sequential" "blis_threaded" "blis_int8"\
+                  "winograd2_sequential" "winograd4_sequential" "fft_sequential"\
+                  "direct_parallel" "gemm_parallel" "blis_parallel" "direct_parallel_usm" "gemm_parallel_usm" "blis_parallel_usm"\
+                  "winograd2_parallel" "winograd4_parallel"\
                   "direct_onednn" "gemm_onednn"; do
   for params in\
     "8  4 4 1024 1024 3 3"\
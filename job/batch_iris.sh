@@ -15,7 +15,8 @@ echo "executable,device,parameters,time1,time2,time3,time4";
 
 device="gpu";
 
-for executable in "direct_parallel" "gemm_parallel" "blis_parallel"\
+for executable in "direct_parallel" "gemm_parallel" "blis_parallel" "direct_parallel_usm" "gemm_parallel_usm" "blis_parallel_usm"\
+                  "winograd2_parallel" "winograd4_parallel"\
                   "direct_onednn" "gemm_onednn" "winograd_onednn"; do
   for params in\
     "8  4 4 1024 1024 3 3"\
@@ -15,7 +15,7 @@ echo "executable,device,parameters,time1,time2,time3,time4";
 
 device="cpu";
 
-for executable in "direct_sequential" "gemm_sequential" "blis_sequential" "im2col" "matmul"; do
+for executable in "direct_sequential" "direct_blocked8" "direct_blocked16" "gemm_sequential" "blis_sequential" "blis_threaded" "blis_int8" "im2col" "matmul"; do
   for params in\
     "8 4 4 64 64 3 3"\
     "8 4 4 128 128 3 3"\
@@ -53,7 +53,7 @@ for executable in "winograd_onednn"; do
   done;
 done;
 
-for executable in "direct_onednn" "gemm_onednn" "direct_parallel" "gemm_parallel" "blis_parallel"; do
+for executable in "direct_onednn" "gemm_onednn" "direct_parallel" "gemm_parallel" "blis_parallel" "direct_parallel_usm" "gemm_parallel_usm" "blis_parallel_usm"; do
   for device in "cpu" "gpu"; do
     for params in\
       "8 4 4 64 64 3 3"\
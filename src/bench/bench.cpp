@@ -0,0 +1,111 @@
+/**
+ * bench.cpp
+ *
+ * Runs every convolution algorithm in the same process and reports the time
+ * of the compute region only, excluding the process startup, the JIT and the
+ * allocation and initialization of the tensors.
+ *
+ * Usage: ./bench (cpu|gpu) WARMUP REPS [N C K H W R S]... [options]
+ */
+
+#include "engines.hpp"
+
+/**
+ * Runs an algorithm WARMUP times untimed, then REPS times, and prints
+ * the median and p95 of the compute time along with the achieved GFLOPS,
+ * the median time of the explicit transfers of the USM engines, the MB
+ * of the workspace of the engines that bound it and the peak MB of the
+ * arena of the CPU engines.
+ */
+void benchmark(const algorithm_t &algorithm, dnnl::engine::kind engine_kind,
+               int warmup, int reps) {
+
+  std::cout << algorithm.name << ","
+            << (engine_kind == dnnl::engine::kind::gpu ? "gpu" : "cpu") << ","
+            << N << " " << C << " " << K << " "
+            << H << " " << W << " " << R << " " << S;
+
+  std::vector<double> times, transfers;
+  if (!measure(algorithm, engine_kind, warmup, reps, times, transfers)) {
+    std::cout << ",failed,failed,failed,failed,failed,failed\n";
+    return;
+  }
+
+  double median = percentile(times, 50);
+  double p95 = percentile(times, 95);
+  double flops = 2.0 * N * K * P * Q * C * R * S;
+
+  std::cout << std::fixed << std::setprecision(6)
+            << "," << median << "," << p95
+            << std::setprecision(3) << "," << flops / median * 1e-9
+            << std::setprecision(6) << "," << percentile(transfers, 50)
+            << std::setprecision(1) << "," << workspace_bytes / 1048576.0 
+            << "," << arena.peak() / 1048576.0
+            << "\n" << std::defaultfloat;
+}
+
+int main(int argc, char **argv) {
+
+  parse_options(argc, argv);
+
+  if (argc < 4 || (argc - 4) % 7 != 0) {
+    std::cout << "Usage: " << argv[0]
+              << " (cpu|gpu) WARMUP REPS [N C K H W R S]..."
+              << " [--bias] [--residual] [--relu|--clip=LO,HI]"
+              << " [--precision=f32|bf16|int8]"
+              << " [--micro-batch=NB [--buffers=2|3]] [--workspace=MB]"
+              << " [--profile=FILE] [--input=FILE] [--filters=FILE]"
+              << " [--output=FILE] [--huge-pages] [--numa]\n";
+    return 1;
+  }
+
+  // The tensor files set the shape, so they only run with their own
+  if (argc > 4 && (!input_path.empty() || !filters_path.empty() || 
+                   !output_path.empty())) {
+    std::cout << "The shapes cannot be given with tensor files.\n";
+    return 1;
+  }
+
+  dnnl::engine::kind engine_kind = parse_arguments(2, argv);
+  int warmup = atoi(argv[2]);
+  int reps = std::max(1, atoi(argv[3]));
+
+  // Use the default dimensions if no shape is given
+  std::vector<std::vector<int>> shapes;
+  if (argc == 4) shapes.push_back({ N,C,K,H,W,R,S });
+  for (int i = 4; i < argc; i += 7) {
+    std::vector<int> shape;
+    for (int j = 0; j < 7; j++) shape.push_back(atoi(argv[i+j]));
+    shapes.push_back(shape);
+  }
+
+  std::cout << "executable,device,parameters,median,p95,gflops,transfer,"
+               "workspace,arena\n";
+
+  for (auto &shape : shapes) {
+    set_dimensions(shape[0], shape[1], shape[2],
+                   shape[3], shape[4], shape[5], shape[6]);
+
+    for (auto &algorithm : algorithms) {
+      if (algorithm.cpu_only && engine_kind != dnnl::engine::kind::cpu)
+        continue;
+      benchmark(algorithm, engine_kind, warmup, reps);
+    }
+  }
+
+  return 0;
+}
+
+//    Copyright 2021 Sara Aguado Couselo
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
@@ -0,0 +1,191 @@
+/**
+ * conv.cpp
+ *
+ * Runs the convolution with the fastest algorithm for the shape and the
+ * device. The first run of a shape benchmarks the candidate algorithms and
+ * saves the winner in a tuning cache, that the later runs reuse.
+ *
+ * Usage: ./conv [cpu|gpu] [N C K H W R S] [options] [--retune]
+ *
+ * The cache is conv_tuning.csv in the working directory, or the file given
+ * by the CONV_TUNING_CACHE environment variable.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include "engines.hpp"
+
+// Untimed and timed runs of every candidate when tuning a shape
+constexpr int TUNING_WARMUP = 1, TUNING_REPS = 3;
+
+// Returns the path of the tuning cache.
+const char *cache_path() {
+  const char *path = std::getenv("CONV_TUNING_CACHE");
+  return path ? path : "conv_tuning.csv";
+}
+
+/**
+ * Returns the key of the current shape in the tuning cache: the kind and
+ * name of the device, the dimensions, the precision, the epilogue and the
+ * micro-batches, which all change the fastest algorithm.
+ */
+std::string tuning_key(dnnl::engine::kind engine_kind) {
+
+  static const char *precisions[] = { "f32", "bf16", "int8" };
+
+  // The key is a CSV field, so the name gets no commas
+  std::string device = sycl::device(select_device(engine_kind))
+                         .get_info<sycl::info::device::name>();
+  std::replace(device.begin(), device.end(), ',', ' ');
+
+  std::ostringstream activation;
+  if (epilogue.activation == activation_t::relu) activation << "relu";
+  if (epilogue.activation == activation_t::clip) 
+    activation << "clip " << epilogue.alpha << " " << epilogue.beta;
+
+  std::ostringstream key;
+  key << (engine_kind == dnnl::engine::kind::gpu ? "gpu" : "cpu") << ","
+      << device << ","
+      << N << "," << C << "," << K << "," << H << "," << W << ","
+      << R << "," << S << "," << precisions[(int)precision] << ","
+      << epilogue.has_bias << "," << epilogue.has_residual << ","
+      << activation.str() << "," << micro_batch << "," << pipeline_depth;
+  return key.str();
+}
+
+/**
+ * Returns the algorithm saved for the key in the tuning cache, or nullptr
+ * if there is none. Later lines override earlier ones.
+ */
+const algorithm_t *lookup(const std::string &key) {
+
+  std::ifstream cache(cache_path());
+  std::string line, name;
+
+  // Lines are key,executable,median
+  while (std::getline(cache, line)) {
+    if (line.compare(0, key.size()+1, key + ",") == 0) {
+      std::string value = line.substr(key.size()+1);
+      name = value.substr(0, value.find(','));
+    }
+  }
+
+  for (auto &algorithm : algorithms) {
+    if (algorithm.name == name) return &algorithm;
+  }
+  return nullptr;
+}
+
+/**
+ * Appends the winner of a shape to the tuning cache, with a header if the
+ * cache is new.
+ */
+void store(const std::string &key, const algorithm_t &algorithm,
+           double median) {
+
+  std::ofstream cache(cache_path(), std::ios::app);
+  if (cache.tellp() == 0) {
+    cache << "device,name,N,C,K,H,W,R,S,precision,bias,residual,"
+             "activation,micro_batch,buffers,executable,median\n";
+  }
+  cache << key << "," << algorithm.name << "," << median << "\n";
+}
+
+/**
+ * Whether an algorithm computes the convolution of the current shape on
+ * the device in the selected precision: the sequential algorithms only run
+ * on the host, the Winograd ones only take 3×3 filters, and only the oneDNN
+ * ones and blis_int8 implement the reduced precisions.
+ */
+bool is_candidate(const algorithm_t &algorithm, dnnl::engine::kind engine_kind) {
+
+  const std::string &name = algorithm.name;
+  bool onednn = name.find("onednn") != std::string::npos;
+
+  if (algorithm.cpu_only && engine_kind != dnnl::engine::kind::cpu)
+    return false;
+  if (name.find("winograd") != std::string::npos && (R != 3 || S != 3))
+    return false;
+
+  switch (precision) {
+    case precision_t::f32:  return name != "blis_int8";
+    case precision_t::bf16: return onednn;
+    case precision_t::int8: return onednn || name == "blis_int8";
+  }
+  return false;
+}
+
+/**
+ * Benchmarks the candidates for the current shape, saves the fastest one in
+ * the tuning cache and returns it, or nullptr if none of them runs. The
+ * time of an algorithm includes its explicit transfers, if any. A candidate
+ * stops being timed once it cannot beat the best one so far.
+ */
+const algorithm_t *tune(dnnl::engine::kind engine_kind,
+                        const std::string &key) {
+
+  const algorithm_t *best = nullptr;
+  double best_time = std::numeric_limits<double>::infinity();
+
+  for (auto &algorithm : algorithms) {
+    if (!is_candidate(algorithm, engine_kind)) continue;
+
+    std::vector<double> times, transfers;
+    if (!measure(algorithm, engine_kind, TUNING_WARMUP, TUNING_REPS,
+                 times, transfers, best_time)) continue;
+
+    double median = percentile(times, 50) + percentile(transfers, 50);
+
+    #ifdef DEBUG
+    std::cout << algorithm.name << ": " << median << " s" << std::endl;
+    #endif
+
+    if (median < best_time) {
+      best = &algorithm;
+      best_time = median;
+    }
+  }
+
+  if (best) store(key, *best, best_time);
+  return best;
+}
+
+int main(int argc, char **argv) {
+
+  // --retune discards the saved choice of the shape
+  bool retune = parse_flag(argc, argv, "--retune");
+
+  dnnl::engine::kind engine_kind = parse_arguments(argc, argv);
+  std::string key = tuning_key(engine_kind);
+
+  const algorithm_t *algorithm = retune ? nullptr : lookup(key);
+  if (!algorithm) algorithm = tune(engine_kind, key);
+
+  if (!algorithm) {
+    std::cout << "No algorithm could compute the convolution.\n";
+    return 1;
+  }
+
+  #ifdef DEBUG
+  std::cout << "Selected " << algorithm->name << std::endl;
+  #endif
+
+  return handle_errors(engine_kind, algorithm->convolution);
+}
+
+//    Copyright 2021 Sara Aguado Couselo
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
@@ -0,0 +1,206 @@
+/**
+ * engines.hpp
+ *
+ * Compiles every convolution algorithm into the same program, each one in 
+ * its own namespace, and lists them in a table, so that bench and conv can
+ * run them all in the same process.
+ */
+
+#ifndef ENGINES_HPP
+#define ENGINES_HPP
+
+#include <algorithm>
+#include <complex>
+#include <cstdint>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <tuple>
+#include <unordered_map>
+#include "../utils.hpp"
+#include "dpc_common.hpp"
+
+#include <omp.h>
+
+#if defined(__x86_64__) && !defined(__SYCL_DEVICE_ONLY__)
+  #include <immintrin.h>
+#endif
+
+// Each engine is compiled inside its own namespace, so that their functions
+// and globals do not collide. Their main() functions are never called. The
+// headers they include must be included above, out of the namespaces.
+namespace direct_sequential {
+  #include "../direct/direct_sequential.cpp"
+}
+namespace direct_parallel {
+  #include "../direct/direct_parallel.cpp"
+}
+namespace direct_parallel_usm {
+  #define USM
+  #include "../direct/direct_parallel.cpp"
+  #undef USM
+}
+namespace direct_blocked8 {
+  #define BLOCK 8
+  #include "../direct/direct_blocked.cpp"
+  #undef BLOCK
+}
+namespace direct_blocked16 {
+  #define BLOCK 16
+  #include "../direct/direct_blocked.cpp"
+  #undef BLOCK
+}
+namespace gemm_sequential {
+  #include "../gemm/gemm_sequential.cpp"
+}
+namespace gemm_parallel {
+  #include "../gemm/gemm_parallel.cpp"
+}
+namespace gemm_parallel_usm {
+  #define USM
+  #include "../gemm/gemm_parallel.cpp"
+  #undef USM
+}
+namespace blis_sequential {
+  #include "../blis/blis_sequential.cpp"
+}
+namespace blis_threaded {
+  #define THREADED
+  #include "../blis/blis_sequential.cpp"
+  #undef THREADED
+}
+namespace blis_int8 {
+  #include "../blis/blis_int8.cpp"
+}
+namespace blis_parallel {
+  #include "../blis/blis_parallel.cpp"
+}
+namespace blis_parallel_usm {
+  #define USM
+  #include "../blis/blis_parallel.cpp"
+  #undef USM
+}
+namespace winograd2_sequential {
+  #define WINOGRAD_M 2
+  #include "../winograd/winograd_sequential.cpp"
+}
+namespace winograd2_parallel {
+  #include "../winograd/winograd_parallel.cpp"
+  #undef WINOGRAD_M
+}
+namespace winograd4_sequential {
+  #define WINOGRAD_M 4
+  #include "../winograd/winograd_sequential.cpp"
+}
+namespace winograd4_parallel {
+  #include "../winograd/winograd_parallel.cpp"
+  #undef WINOGRAD_M
+}
+namespace fft_sequential {
+  #include "../fft/fft_sequential.cpp"
+}
+namespace direct_onednn {
+  #define DIRECT
+  #include "../onednn/onednn.cpp"
+  #undef DIRECT
+}
+namespace winograd_onednn {
+  #define WINOGRAD
+  #include "../onednn/onednn.cpp"
+  #undef WINOGRAD
+}
+namespace gemm_onednn {
+  #define GEMM
+  #include "../onednn/onednn.cpp"
+  #undef GEMM
+}
+
+/**
+ * Struct to describe an algorithm under test
+ */
+struct algorithm_t {
+  std::string name;
+  std::function<void(dnnl::engine::kind)> convolution;
+  bool cpu_only; // sequential algorithms always run on the host
+};
+
+const std::vector<algorithm_t> algorithms = {
+  { "direct_sequential",    [](auto) { direct_sequential::convolution(); }, true },
+  { "direct_blocked8",      [](auto) { direct_blocked8::convolution(); }, true },
+  { "direct_blocked16",     [](auto) { direct_blocked16::convolution(); }, true },
+  { "gemm_sequential",      [](auto) { gemm_sequential::convolution(); }, true },
+  { "blis_sequential",      [](auto) { blis_sequential::convolution(); }, true },
+  { "blis_threaded",        [](auto) { blis_threaded::convolution(); }, true },
+  { "blis_int8",            [](auto) { blis_int8::convolution(); }, true },
+  { "winograd2_sequential", [](auto) { winograd2_sequential::convolution(); }, true },
+  { "winograd4_sequential", [](auto) { winograd4_sequential::convolution(); }, true },
+  { "fft_sequential",       [](auto) { fft_sequential::convolution(); }, true },
+  { "direct_parallel",      direct_parallel::convolution, false },
+  { "gemm_parallel",        gemm_parallel::convolution, false },
+  { "blis_parallel",        blis_parallel::convolution, false },
+  { "direct_parallel_usm",  direct_parallel_usm::convolution, false },
+  { "gemm_parallel_usm",    gemm_parallel_usm::convolution, false },
+  { "blis_parallel_usm",    blis_parallel_usm::convolution, false },
+  { "winograd2_parallel",   winograd2_parallel::convolution, false },
+  { "winograd4_parallel",   winograd4_parallel::convolution, false },
+  { "direct_onednn",        direct_onednn::convolution, false },
+  { "winograd_onednn",      winograd_onednn::convolution, false },
+  { "gemm_onednn",          gemm_onednn::convolution, false },
+};
+
+/**
+ * Returns the value at the given percentile of a sorted vector.
+ */
+double percentile(const std::vector<double> &sorted, double pct) {
+  size_t i = std::ceil(pct / 100 * sorted.size());
+  return sorted[std::max<size_t>(i, 1) - 1];
+}
+
+/**
+ * Runs an algorithm WARMUP times untimed, then REPS times, and stores the
+ * sorted compute and explicit transfer times of the timed runs. Returns 
+ * false if any run fails, or as soon as more than half of the timed runs,
+ * transfers included, take longer than cutoff: their median cannot be
+ * below it any more.
+ */
+bool measure(const algorithm_t &algorithm, dnnl::engine::kind engine_kind,
+             int warmup, int reps, std::vector<double> &times, 
+             std::vector<double> &transfers, double cutoff = INFINITY) {
+
+  auto run = [&]() { 
+    transfer_time = 0;
+    workspace_bytes = 0;
+    arena.reset_peak();
+    algorithm.convolution(engine_kind); 
+  };
+
+  int slower = 0;
+  for (int i = 0; i < warmup + reps; i++) {
+    if (handle_errors(engine_kind, run)) return false;
+    if (i < warmup) continue;
+    times.push_back(compute_time);
+    transfers.push_back(transfer_time);
+    if (compute_time + transfer_time > cutoff && ++slower > reps / 2) 
+      return false;
+  }
+
+  std::sort(times.begin(), times.end());
+  std::sort(transfers.begin(), transfers.end());
+  return true;
+}
+
+#endif
+
+//    Copyright 2021 Sara Aguado Couselo
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
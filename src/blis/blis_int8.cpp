@@ -0,0 +1,405 @@
+/**
+ * blis_int8.cpp
+ *
+ * Implements the gemm-based convolution algorithm in forward propagation mode
+ * in int8, as blis_sequential.cpp does in f32: the filters are quantized to s8
+ * with a scale per output channel, the input to u8 with a scale and a zero
+ * point, and the products are accumulated in int32 and dequantized to f32
+ * with the epilogue when the last block of kc has been accumulated.
+ *
+ * The packed panels keep groups of 4 consecutive elements of the kc dimension
+ * together, as the VNNI instruction vpdpbusd multiplies 4 u8 by 4 s8 and adds
+ * them to each 32-bit lane. CPUs without AVX512-VNNI use a portable kernel.
+ */
+
+#include "../utils.hpp"
+#include <cstdint>
+
+#if defined(__x86_64__) && !defined(__SYCL_DEVICE_ONLY__)
+  #include <immintrin.h>
+#endif
+
+int
+  KC = 512,  // multiple of 4
+  NC = 6144,
+  MC = 96,
+  NR = 12,
+  MR = 8;
+
+int HW=H*W, RS=R*S, PQ=P*Q;
+
+// Offset in x of every row (c,r,s) of im2col(x): c*HW + r*W + s
+std::vector<int> row_offsets;
+
+/**
+ * Signature of the micro-kernels: C[MR×NR] += A[MR×kc] · B[kc×NR], with kc
+ * given in groups of 4, reading A and B from packed micro-panels and C with
+ * leading dimension ldc.
+ */
+typedef void (*micro_kernel_t)(int kg, int8_t *A, uint8_t *B, int32_t *C,
+                               int ldc);
+
+/**
+ * Portable micro-kernel, used when the CPU has no AVX512-VNNI.
+ */
+template <int mr, int nr>
+void micro_kernel_generic(int kg, int8_t *A, uint8_t *B, int32_t *C, int ldc) {
+
+  int32_t C_reg[mr][nr] = {};
+
+  for (int g = 0; g < kg; g++, A += mr*4, B += nr*4) {
+    for (int i = 0; i < mr; i++) {
+      for (int j = 0; j < nr; j++) {
+        for (int t = 0; t < 4; t++) {
+          C_reg[i][j] += A[i*4+t] * B[j*4+t];
+        }
+      }
+    }
+  }
+
+  for (int i = 0; i < mr; i++) {
+    for (int j = 0; j < nr; j++) {
+      C[i*ldc+j] += C_reg[i][j];
+    }
+  }
+}
+
+#if defined(__x86_64__) && !defined(__SYCL_DEVICE_ONLY__)
+
+/**
+ * 8×32 micro-kernel: keeps C in 16 zmm registers and, for each group of 4
+ * elements of kc, loads 4 rows of B in two registers and broadcasts the
+ * 4 elements of each of the eight rows of A as a 32-bit word.
+ */
+__attribute__((target("avx512f,avx512vnni")))
+void micro_kernel_vnni(int kg, int8_t *A, uint8_t *B, int32_t *C, int ldc) {
+
+  __m512i C_reg[8][2];
+  for (int i = 0; i < 8; i++) {
+    C_reg[i][0] = _mm512_loadu_si512(&C[i*ldc]);
+    C_reg[i][1] = _mm512_loadu_si512(&C[i*ldc+16]);
+  }
+
+  for (int g = 0; g < kg; g++, A += 8*4, B += 32*4) {
+    __m512i B0 = _mm512_loadu_si512(&B[0]);
+    __m512i B1 = _mm512_loadu_si512(&B[64]);
+
+    for (int i = 0; i < 8; i++) {
+      int32_t a;
+      std::memcpy(&a, &A[i*4], 4);
+      __m512i Ai = _mm512_set1_epi32(a);
+      C_reg[i][0] = _mm512_dpbusd_epi32(C_reg[i][0], B0, Ai);
+      C_reg[i][1] = _mm512_dpbusd_epi32(C_reg[i][1], B1, Ai);
+    }
+  }
+
+  for (int i = 0; i < 8; i++) {
+    _mm512_storeu_si512(&C[i*ldc],    C_reg[i][0]);
+    _mm512_storeu_si512(&C[i*ldc+16], C_reg[i][1]);
+  }
+}
+
+#endif
+
+micro_kernel_t micro_kernel = micro_kernel_generic<8,12>;
+
+/**
+ * Picks the VNNI micro-kernel if the CPU supports it and sets MR and NR
+ * to its register block size. MC and NC are multiples of all of them.
+ */
+void select_micro_kernel() {
+
+  #if defined(__x86_64__) && !defined(__SYCL_DEVICE_ONLY__)
+  if (__builtin_cpu_supports("avx512vnni")) {
+    micro_kernel = micro_kernel_vnni; MR = 8; NR = 32;
+    return;
+  }
+  #endif
+
+  micro_kernel = micro_kernel_generic<8,12>; MR = 8; NR = 12;
+}
+
+/**
+ * Computes an edge tile of mr×nr elements (mr <= MR, nr <= NR) through a
+ * full MR×NR tile in scratch memory.
+ */
+void micro_kernel_edge(int kg, int8_t *A, uint8_t *B, int32_t *C, int ldc,
+                       int mr, int nr) {
+
+  int32_t C_tmp[8*32] = {}; // largest MR×NR
+  micro_kernel(kg, A, B, C_tmp, NR);
+
+  for (int i = 0; i < mr; i++) {
+    for (int j = 0; j < nr; j++) {
+      C[i*ldc+j] += C_tmp[i*NR+j];
+    }
+  }
+}
+
+/**
+ * Quantization parameters: x ≈ (x_q - x_zero) / x_scale and, for every
+ * output channel k, f ≈ f_q / f_scale[k].
+ */
+struct quantization_t {
+  float x_scale;
+  int x_zero;
+  std::vector<float> y_scale;        // 1 / (x_scale · f_scale[k])
+  std::vector<int32_t> compensation; // x_zero · Σ f_q[k], per output channel
+};
+
+/**
+ * Quantizes the filters to s8, symmetrically with a scale per output channel.
+ */
+void quantize_filters(int8_t *f_q, float *f, std::vector<float> &f_scale) {
+
+  for (int k = 0; k < K; k++) {
+    float f_max = 0;
+    for (int i = 0; i < C*RS; i++) f_max = fmax(f_max, fabs(f[k*C*RS + i]));
+    f_scale[k] = f_max > 0 ? 127 / f_max : 1;
+
+    for (int i = 0; i < C*RS; i++) {
+      f_q[k*C*RS + i] = std::nearbyint(f[k*C*RS + i] * f_scale[k]);
+    }
+  }
+}
+
+/**
+ * Quantizes the input to u8 with a scale and a zero point calibrated on the
+ * range of the batch, which always includes 0, and computes the factors to
+ * dequantize the output.
+ */
+void quantize_input(uint8_t *x_q, float *x, size_t size, int8_t *f_q,
+                    std::vector<float> &f_scale, quantization_t &quant) {
+
+  float lo = 0, hi = 0;
+  for (size_t i = 0; i < size; i++) {
+    lo = fmin(lo, x[i]);
+    hi = fmax(hi, x[i]);
+  }
+
+  quant.x_scale = hi > lo ? 255 / (hi - lo) : 1;
+  quant.x_zero = std::nearbyint(-lo * quant.x_scale);
+
+  for (size_t i = 0; i < size; i++) {
+    float v = std::nearbyint(x[i] * quant.x_scale) + quant.x_zero;
+    x_q[i] = fmin(fmax(v, 0), 255);
+  }
+
+  // The zero point adds x_zero·f_q to every product, once per element of f
+  for (int k = 0; k < K; k++) {
+    int32_t sum = 0;
+    for (int i = 0; i < C*RS; i++) sum += f_q[k*C*RS + i];
+    quant.compensation[k] = quant.x_zero * sum;
+    quant.y_scale[k] = 1 / (quant.x_scale * f_scale[k]);
+  }
+}
+
+/**
+ * Dequantizes a tile of mr×nr elements at row i0 and column j0 of C to y,
+ * and applies the epilogue, once its last block of kc has been accumulated
+ * and while it is still in cache. y_off is the position of y in the output
+ * tensor.
+ */
+void requantize_tile(float *y, int32_t *C, int ldc, int mr, int nr,
+                     int i0, int j0, quantization_t &quant,
+                     float *bias, float *residual, size_t y_off) {
+
+  for (int i = 0; i < mr; i++) {
+    int k = i0+i;
+    for (int j = 0; j < nr; j++) {
+      size_t y_idx = (size_t)(i0+i)*ldc + j0+j;
+      float v = (C[i*ldc+j] - quant.compensation[k]) * quant.y_scale[k];
+      y[y_idx] = epilogue.apply(v, bias, residual, k, y_off + y_idx);
+    }
+  }
+}
+
+/**
+ * Packs a block of matrix A into the buffer A_pack as micro-panels of
+ * MR rows, stored in groups of 4 columns: the 4 elements of a row in a group
+ * are contiguous. Rows beyond M and columns beyond K are padded with zeros.
+ */
+void pack_A(int8_t *A_pack, int8_t *A, int lda, int M, int K, int K4) {
+
+  for (int ir = 0; ir < M; ir += MR) {
+    for (int k = 0; k < K4; k++) {
+      for (int i = 0; i < MR; i++) {
+        A_pack[ir*K4 + (k/4)*MR*4 + i*4 + k%4] =
+          (ir+i < M && k < K) ? A[(ir+i)*lda+k] : 0;
+      }
+    }
+  }
+}
+
+/**
+ * Packs a block of matrix B into the buffer B_pack doing the im2col, as
+ * micro-panels of NR columns stored in groups of 4 rows: the 4 elements of
+ * a column in a group are contiguous. Columns beyond nc and rows beyond kc
+ * are padded with zeros.
+ *
+ * As in the f32 engines, the offset in x of row pc+ps, (c,r,s), comes from
+ * row_offsets, and the columns are walked as runs of consecutive q, 
+ * contiguous in x, each one interleaved into the groups of its micro-panel.
+ */
+void pack_B(uint8_t *B_pack, uint8_t *B, int pc, int jc, int kc, int kc4,
+            int nc) {
+
+  int p0 = jc / Q, q0 = jc % Q;
+
+  for (int ps = 0; ps < kc4; ps++) {
+    // Position of row ps in the groups of the first micro-panel
+    uint8_t *B_group = &B_pack[(ps/4)*NR*4 + ps%4];
+    int js = 0;
+
+    if (ps < kc) {
+      uint8_t *B_row = &B[row_offsets[pc+ps]];
+      int p = p0, q = q0;
+
+      while (js < nc) {
+        int run = std::min(Q - q, nc - js); // columns left in the output row
+        int jr = js % NR;
+        int len = std::min(run, NR - jr);   // columns left in the micro-panel
+        uint8_t *src = &B_row[p*W + q];
+        uint8_t *dst = &B_group[(js-jr)*kc4 + jr*4];
+
+        for (int j = 0; j < len; j++) dst[j*4] = src[j];
+
+        js += len; q += len;
+        if (q == Q) { q = 0; p++; }
+      }
+    }
+
+    for (; js < nc || js % NR; js++) {
+      B_group[(js/NR)*NR*kc4 + (js%NR)*4] = 0;
+    }
+  }
+}
+
+/**
+ * Matrix multiplication with implicit im2col in int8, accumulated in C,
+ * and the dequantization and the epilogue into y.
+ */
+void blis(float *y, int32_t *C, int8_t *A, uint8_t *B, int m, int n, int k,
+          quantization_t &quant, float *bias, float *residual, size_t y_off) {
+
+  // Reused from the arena for every image
+  arena_buffer_t<int8_t> A_pack((size_t)MC*KC);
+  arena_buffer_t<uint8_t> B_pack((size_t)KC*NC);
+
+  int lda = k;
+  int ldc = n;
+
+  std::fill(C, C + (size_t)m*n, 0);
+
+  for (int jc = 0; jc < n; jc += NC) {
+    int nc = fmin(NC, n-jc);
+
+    for (int pc = 0; pc < k; pc += KC) {
+      int kc = fmin(KC, k-pc);
+      int kc4 = (kc+3)/4*4;
+
+      pack_B(B_pack, B, pc, jc, kc, kc4, nc); // PACK B
+
+      for (int ic = 0; ic < m; ic += MC) {
+        int mc = fmin(MC, m-ic);
+
+        pack_A(A_pack, &A[ic*lda + pc], lda, mc, kc, kc4); // PACK A
+        int32_t *C_pack = &C[ic*ldc + jc];
+
+        for (int jr = 0; jr < nc; jr += NR) {
+          int nr = fmin(NR, nc-jr);
+
+          for (int ir = 0; ir < mc; ir += MR) {
+            int mr = fmin(MR, mc-ir);
+
+            int8_t *Ar = &A_pack[ir*kc4];
+            uint8_t *Br = &B_pack[jr*kc4];
+            int32_t *Cr = &C_pack[ir*ldc + jr];
+
+            if (mr == MR && nr == NR) {
+              micro_kernel(kc4/4, Ar, Br, Cr, ldc);
+            } else {
+              micro_kernel_edge(kc4/4, Ar, Br, Cr, ldc, mr, nr);
+            }
+
+            if (pc+kc == k) {
+              requantize_tile(y, Cr, ldc, mr, nr, ic+ir, jc+jr, quant,
+                              bias, residual, y_off);
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+/**
+ * Quantization + im2col transformation + matrix multiplication. The filters
+ * are quantized once, as a model is, and the input is quantized within the
+ * timed region.
+ */
+void convolution() {
+
+  arena_vector_t<float> x_vec(N*C*H*W);
+  arena_vector_t<float> f_vec(K*C*R*S);
+  arena_vector_t<float> y_vec(N*K*P*Q);
+  std::vector<float> bias_vec, residual_vec;
+
+  init_data(x_vec, f_vec, y_vec);
+  init_epilogue(bias_vec, residual_vec);
+
+  HW=H*W; RS=R*S; PQ=P*Q;
+  row_offsets.resize(C*R*S);
+  for (int c = 0; c < C; c++) {
+    for (int r = 0; r < R; r++) {
+      for (int s = 0; s < S; s++) {
+        row_offsets[(c*R + r)*S + s] = c*HW + r*W + s;
+      }
+    }
+  }
+  select_micro_kernel();
+
+  // Quantized tensors and accumulators, from the arena
+  arena_buffer_t<int8_t> f_q((size_t)K*C*R*S);
+  arena_buffer_t<uint8_t> x_q((size_t)N*C*H*W);
+  arena_buffer_t<int32_t> C_acc((size_t)K*P*Q); // reused for every image
+  std::vector<float> f_scale(K);
+  quantization_t quant = { 1, 0, std::vector<float>(K),
+                           std::vector<int32_t>(K) };
+
+  quantize_filters(f_q.data(), f_vec.data(), f_scale);
+
+  compute_begin();
+  quantize_input(x_q.data(), x_vec.data(), x_vec.size(), f_q.data(),
+                 f_scale, quant);
+  for (int n = 0; n < N; n++) {
+    blis(&y_vec[n*K*P*Q], C_acc.data(), f_q.data(), &x_q[n*C*H*W],
+         K, P*Q, C*R*S, quant, bias_vec.data(), residual_vec.data(),
+         (size_t)n*K*P*Q);
+  }
+  compute_end();
+
+  save_output(y_vec);
+
+  #ifdef DEBUG // only run the sequential convolution if debugging
+  error_stats(cpu_convolution(), y_vec); // quantization changes the result
+  #endif
+}
+
+int main(int argc, char **argv) {
+  return handle_errors(parse_arguments(argc,argv), convolution);
+}
+
+//    Copyright 2021 Sara Aguado Couselo
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
@@ -9,122 +9,329 @@
 #include "../utils.hpp"
 #include "dpc_common.hpp"
 
-#define SIZE 3072
-#define MIN(a,b) ((a)<(b)?(a):(b))
+/**
+ * Tiling of the kernel: each work-group computes a TM×TN tile of the output
+ * matrix, staging TK×TM filters and TK×TN im2col'ed inputs in local memory,
+ * and each of its WG work-items computes WM×WN outputs of the tile.
+ */
+constexpr int TK = 16, WM = 4, WN = 4, WG = 64;
 
 /**
  * Struct to pass the dimensions to the kernel
  */
 struct constants_t {
   int N,C,K,H,W,R,S,P,Q; // tensor constants
-  int CHW,HW,RS,QN,HWN,WN,PQ,CRS,PQN; // precomputed variables
+  int CHW,HW,RS,PQ,CRS,KPQ,NPQ; // precomputed variables
 } constants;
 
 /**
- * Performs a simple matrix multiplication.
+ * Submits the kernel of a batch of images to the command group: 
+ * y = f · im2col(x), where the columns of im2col(x) are ordered by (n,p,q),
+ * so y is stored as NKPQ. The tensors are accessors in the buffer mode and
+ * device pointers in the USM mode.
  */
-void matmul(
-  sycl::accessor<float, 1, cl::sycl::access::mode::write> C, 
-  sycl::accessor<float, 1, cl::sycl::access::mode::read>  A, 
-  float *B, int M, int N, int K, int ldb, int ldc, int a_off, int c_off) {
-  
-  for (int m = 0; m < M; m++) {
-    for (int k = 0; k < K; k++) {
-      for (int n = 0; n < N; n++) {
-        C[c_off + m*ldc+n] += A[a_off + m*K+k] * B[k*ldb+n];
-      }
-    }
-  }
-}
+template <class X, class F, class Y, class Bias, class Residual, class Args>
+void submit_convolution(sycl::handler &context, int batch, X x, F f, Y y, 
+                        Bias bias, Residual residual, Args args) {
 
-/**
- * Packs a column of matrix B into the buffer B_pack 
- * doing the im2col and the format transformation.
- */
-void pack_B(float *B_pack, sycl::accessor<float, 1, cl::sycl::access::mode::read> B,
-  int pc, int jc, int kc, constants_t arg) {
+  epilogue_t epi = epilogue; // globals are not accessible from the kernel
 
-  for (int ps = 0; ps < kc; ps++) {
+  // Work-items along K and along N·P·Q: use less rows if there are few filters
+  const int lm = K <= WM ? 1 : K <= 2*WM ? 2 : 4;
+  const int ln = WG / lm;
+  const int TM = lm * WM, TN = ln * WN;
+  const int groups_m = (K + TM-1) / TM;
+  const int groups_n = (batch*P*Q + TN-1) / TN;
 
-    int tmp1 = (pc+ps)%arg.RS;
-    int c = (pc+ps)/arg.RS;
-    int r = tmp1/arg.R;
-    int s = tmp1%arg.R;
+  // Tiles of the filters and of the im2col'ed input in local memory
+  sycl::accessor<float, 1, sycl::access::mode::read_write, 
+    sycl::access::target::local> A_tile(sycl::range(TK*TM), context);
+  sycl::accessor<float, 1, sycl::access::mode::read_write, 
+    sycl::access::target::local> B_tile(sycl::range(TK*TN), context);
+
+  context.parallel_for(sycl::nd_range(
+    sycl::range(groups_m*lm, groups_n*ln), sycl::range(lm, ln)
+  ), [=](sycl::nd_item<2> item) {
     
-    int tmp2 = jc%arg.PQ;
-    int n = jc/arg.PQ;
-    int p = tmp2/arg.P;
-    int q = tmp2%arg.P;
+    auto arg = args[0];
+    int li = item.get_local_id(0);
+    int lj = item.get_local_id(1);
+    int tid = li*ln + lj;
+    int row0 = item.get_group(0) * TM;
+    int col0 = item.get_group(1) * TN;
 
-    B_pack[ps] = B[n*arg.CHW + c*arg.HW + (p+r)*arg.W + (q+s)];
-  }
+    // Offsets in x of the columns of B_tile this work-item loads
+    // (TN is a multiple of WG, at most WG*WN columns)
+    int x_off[WN];
+    for (int t = 0; t < TN/WG; t++) {
+      int j = col0 + tid + t*WG;
+      int n = j / arg.PQ;
+      int p = (j % arg.PQ) / arg.Q;
+      int q = (j % arg.PQ) % arg.Q;
+      x_off[t] = j < arg.NPQ ? n*arg.CHW + p*arg.W + q : -1;
+    }
+
+    float acc[WM][WN] = {};
+
+    for (int pc = 0; pc < arg.CRS; pc += TK) {
+
+      // Stage the TK×TM block of f, transposed
+      for (int e = tid; e < TK*TM; e += WG) {
+        int kk = e / TM, m = e % TM;
+        int row = row0 + m, col = pc + kk;
+        A_tile[e] = (row < arg.K && col < arg.CRS) ? f[row*arg.CRS + col] : 0;
+      }
+
+      // Stage the TK×TN block of im2col(x)
+      for (int kk = 0; kk < TK; kk++) {
+        int crs = pc + kk;
+        int c = crs / arg.RS;
+        int r = (crs % arg.RS) / arg.S;
+        int s = (crs % arg.RS) % arg.S;
+        int off = c*arg.HW + r*arg.W + s;
+
+        for (int t = 0; t < TN/WG; t++) {
+          bool valid = crs < arg.CRS && x_off[t] >= 0;
+          B_tile[kk*TN + tid + t*WG] = valid ? x[x_off[t] + off] : 0;
+        }
+      }
+
+      item.barrier(sycl::access::fence_space::local_space);
+
+      // Accumulate the WM×WN block in registers
+      for (int kk = 0; kk < TK; kk++) {
+        float a[WM], b[WN];
+        for (int i = 0; i < WM; i++) a[i] = A_tile[kk*TM + li + i*lm];
+        for (int j = 0; j < WN; j++) b[j] = B_tile[kk*TN + lj + j*ln];
+
+        for (int i = 0; i < WM; i++) {
+          for (int j = 0; j < WN; j++) {
+            acc[i][j] += a[i] * b[j];
+          }
+        }
+      }
+
+      item.barrier(sycl::access::fence_space::local_space);
+    }
+
+    // Store the block: column j = (n,p,q) goes to y[n][k][p][q]
+    for (int i = 0; i < WM; i++) {
+      int k = row0 + li + i*lm;
+      for (int j = 0; j < WN; j++) {
+        int col = col0 + lj + j*ln;
+        if (k < arg.K && col < arg.NPQ) {
+          int y_off = (col / arg.PQ)*arg.KPQ + k*arg.PQ + col % arg.PQ;
+          y[y_off] = epi.apply(acc[i][j], bias, residual, k, y_off);
+        }
+      }
+    }
+  });
 }
 
+#ifdef USM
+
+// Device memory, reused across calls
+usm_array_t<float> x_dev, f_dev, y_dev, bias_dev, residual_dev;
+usm_array_t<constants_t> args_dev;
+// Pinned host slots of the micro-batches, reused across calls
+staging_t x_stage, y_stage, residual_stage;
+
+#endif
+
 /**
- * im2col transformation + matrix multiplication
+ * im2col transformation + matrix multiplication: y = f · im2col(x), where
+ * the columns of im2col(x) are ordered by (n,p,q), so y is stored as NKPQ.
+ *
+ * Compiled with -DUSM (blis_parallel_usm target), the tensors live in 
+ * device memory allocated once with malloc_device, on a queue also created
+ * once, and are moved with explicit memcpy, timed in transfer_time. With
+ * --micro-batch, the batch is streamed through them with stream_batches().
  */
 void convolution(dnnl::engine::kind engine_kind) {
 
-  constants = { N,C,K,H,W,R,S,P,Q,C*H*W,H*W,R*S,Q*N,H*W*N,W*N,P*Q,C*R*S,P*Q*N };
+  constants = { N,C,K,H,W,R,S,P,Q,C*H*W,H*W,R*S,P*Q,C*R*S,K*P*Q,N*P*Q };
 
-  std::vector<float> x_vec(N*C*H*W);
-  std::vector<float> f_vec(K*C*R*S);
-  std::vector<float> y_vec(N*K*P*Q);
+  // The USM engines use the tensors of the files in place, if they can, and
+  // give them no vectors
+  #ifdef USM
+  bool mapped = true;
+  #else
+  bool mapped = false;
+  #endif
+  std::vector<float> x_vec(mapped && in_place(input_file, N, C, H, W) 
+                           ? 0 : (size_t)N*C*H*W);
+  std::vector<float> f_vec(mapped && in_place(filters_file, K, C, R, S) 
+                           ? 0 : (size_t)K*C*R*S);
+  std::vector<float> y_vec(mapped && in_place(output_file, N, K, P, Q) 
+                           ? 0 : (size_t)N*K*P*Q);
+  std::vector<float> bias_vec, residual_vec;
 
   init_data(x_vec, f_vec, y_vec);
+  init_epilogue(bias_vec, residual_vec);
+  numa_spread(engine_kind, x_vec, y_vec);
+
+  #ifndef USM
 
   {
 
     // Initialize the device queue with the custom selector. The device queue is
     // used to enqueue kernels. It encapsulates all states needed for execution.
     sycl::queue device_queue(
-      select_device(engine_kind), dpc_common::exception_handler
+      select_device(engine_kind), dpc_common::exception_handler, 
+      queue_properties()
     );
     
     #ifdef DEBUG
     std::cout << device_queue.get_device().get_info<sycl::info::device::name>();
     #endif
 
-    // Create buffers for tensors, buffer c is bound with host memory y_vec
-    // Allocate DPC++ buffers for input and output memory objects
-    sycl::buffer x_buf(x_vec.data(), sycl::range(N*C*H*W));
-    sycl::buffer f_buf(f_vec.data(), sycl::range(K*C*R*S));
-    sycl::buffer y_buf(y_vec.data(), sycl::range(N*K*P*Q));
-    sycl::buffer args_buf(&constants, sycl::range(1));
+    // Create buffers for tensors. They are not bound to the host memory, but
+    // filled and read back with explicit copies, so that the profile reports
+    // every transfer
+    sycl::buffer<float, 1> x_buf{sycl::range<1>(x_vec.size())};
+    sycl::buffer<float, 1> f_buf{sycl::range<1>(f_vec.size())};
+    sycl::buffer<float, 1> y_buf{sycl::range<1>(y_vec.size())};
+    sycl::buffer<float, 1> bias_buf{sycl::range<1>(bias_vec.size())};
+    sycl::buffer<float, 1> residual_buf{sycl::range<1>(residual_vec.size())};
+    sycl::buffer<constants_t, 1> args_buf{sycl::range<1>(1)};
+
+    compute_begin();
+
+    copy_to_buffer(device_queue, "x", x_vec.data(), x_buf);
+    copy_to_buffer(device_queue, "f", f_vec.data(), f_buf);
+    copy_to_buffer(device_queue, "bias", bias_vec.data(), bias_buf);
+    if (epilogue.has_residual) {
+      copy_to_buffer(device_queue, "residual", residual_vec.data(), 
+                     residual_buf);
+    }
+    copy_to_buffer(device_queue, "args", &constants, args_buf);
 
     // Submit command group to queue to perform matmul
-    device_queue.submit([&](sycl::handler &context) {
+    profile("kernel", "convolution", 
+            device_queue.submit([&](sycl::handler &context) {
 
       sycl::accessor x = x_buf.get_access<cl::sycl::access::mode::read>(context);
       sycl::accessor f = f_buf.get_access<cl::sycl::access::mode::read>(context);
       sycl::accessor y = y_buf.get_access<cl::sycl::access::mode::write>(context);
+      sycl::accessor bias(bias_buf, context, sycl::read_only);
+      sycl::accessor residual(residual_buf, context, sycl::read_only);
       sycl::accessor args(args_buf, context, sycl::read_only);
 
-      context.parallel_for(sycl::range(P,Q,N), [=](auto index) {
-        
-        auto arg = args[0];
-        int p = index[0];
-        int q = index[1];
-        int n = index[2];
-        int jc = p*arg.QN + q*arg.N + n;
+      submit_convolution(context, N, x, f, y, bias, residual, args);
+    })).wait_and_throw();
 
-        float B_pack[SIZE];
-        for (int pc = 0; pc < arg.CRS; pc += SIZE) {
-          int kc = MIN(SIZE, arg.CRS-pc);
+    compute_end();
 
-          // Pack an entire column of matrix B into B_pack, sequential memory
-          pack_B(B_pack, x, pc, jc, kc, arg);
+    // Read the output back, out of the compute region
+    copy_from_buffer(device_queue, "y", y_buf, y_vec.data()).wait();
 
-          // Perform matrix multiplication over the packed memory
-          matmul(y, f, B_pack, arg.K, 1, kc, 1, arg.PQN, pc, jc);
-        }
-      });
-    });
+    write_profile(device_queue, "blis_parallel");
+
+  }
+
+  #else // USM
+
+  sycl::queue &device_queue = get_queue(engine_kind);
+
+  #ifdef DEBUG
+  std::cout << device_queue.get_device().get_info<sycl::info::device::name>();
+  #endif
+
+  // Micro-batches of nb images, each one in one of the sets of buffers
+  int nb = micro_batch ? std::min(micro_batch, N) : N;
+  int depth = nb < N ? pipeline_depth : 1;
+  size_t x_size = (size_t)nb*C*H*W, y_size = (size_t)nb*K*P*Q;
+  size_t residual_size = epilogue.has_residual ? y_size : 0;
+
+  float *x = x_dev.get(device_queue, depth*x_size);
+  float *f = f_dev.get(device_queue, (size_t)K*C*R*S);
+  float *y = y_dev.get(device_queue, depth*y_size);
+  float *bias = bias_dev.get(device_queue, bias_vec.size());
+  float *residual = residual_dev.get(device_queue, depth*residual_size);
+  constants_t *args = args_dev.get(device_queue, depth);
+  x_stage.init(device_queue, depth, x_size);
+  y_stage.init(device_queue, depth, y_size);
+  residual_stage.init(device_queue, depth, residual_size);
+  // One host copy of the constants per micro-batch, as they are copied
+  // asynchronously
+  std::vector<constants_t> batch_constants((N+nb-1)/nb, constants);
+  // Host tensors, in the mapping of their files if used in place
+  float *x_host = host_data(input_file, x_vec);
+  float *f_host = host_data(filters_file, f_vec);
+  float *y_host = host_data(output_file, y_vec);
+
+  // Copy the filters to the device, once for all the micro-batches
+  transfer_time = 0;
+  transfer_begin();
+  profile("copy", "f", 
+          copy_to_device(device_queue, f, f_host, (size_t)K*C*R*S)).wait();
+  profile("copy", "bias", copy_to_device(device_queue, bias, bias_vec)).wait();
+  transfer_end();
+
+  stream_batches(device_queue, N, nb, depth,
+
+    // Copy the images of the micro-batch and their residual to the slot
+    [&](int n0, int size, int slot, std::vector<sycl::event> deps) {
+      constants_t &batch = batch_constants[n0/nb];
+      batch.N = size;
+      batch.NPQ = size*P*Q;
+      // Read ahead this micro-batch and the next one, and drop the ones 
+      // already copied: only the depth-1 before it can be in flight
+      stream_file(input_file, x_host, (size_t)n0*C*H*W, 2*x_size, 
+                  (depth-1)*x_size);
+      std::vector<sycl::event> copies = {
+        profile("copy", "x", 
+          device_queue.memcpy(&x[slot*x_size], 
+            x_stage.in(&x_host[(size_t)n0*C*H*W], (size_t)size*C*H*W, slot),
+            (size_t)size*C*H*W*sizeof(float), deps)),
+        profile("copy", "args", 
+          device_queue.memcpy(&args[slot], &batch, sizeof(constants_t), deps))
+      };
+      if (residual_size) {
+        copies.push_back(profile("copy", "residual", 
+          device_queue.memcpy(&residual[slot*residual_size], 
+            residual_stage.in(&residual_vec[(size_t)n0*K*P*Q], 
+                              (size_t)size*K*P*Q, slot),
+            (size_t)size*K*P*Q*sizeof(float), deps)));
+      }
+      return copies;
+    },
+
+    // Submit command group to queue to perform matmul
+    [&](int n0, int size, int slot, std::vector<sycl::event> deps) {
+      return profile("kernel", "convolution", 
+        device_queue.submit([&](sycl::handler &context) {
+          context.depends_on(deps);
+          submit_convolution(context, size, &x[slot*x_size], f, 
+                             &y[slot*y_size], bias, 
+                             &residual[slot*residual_size], &args[slot]);
+        }));
+    },
+
+    // Copy the outputs back to the host
+    [&](int n0, int size, int slot, std::vector<sycl::event> deps) {
+      return profile("copy", "y", 
+        device_queue.memcpy(y_stage.out(&y_host[(size_t)n0*K*P*Q], slot),
+                            &y[slot*y_size], (size_t)size*K*P*Q*sizeof(float),
+                            deps));
+    },
+
+    // Move the outputs out of their pinned slot, if staged, let the ones
+    // written to the file reach it, and read ahead the next
+    [&](int n0, int size, int slot) {
+      y_stage.drain(&y_host[(size_t)n0*K*P*Q], (size_t)size*K*P*Q, slot);
+      stream_file(output_file, y_host, (size_t)(n0+size)*K*P*Q, y_size, 0);
+    }
+  );
+
+  write_profile(device_queue, "blis_parallel_usm");
+
+  #endif
 
-  } // y_vec is updated when y_buf is destroyed upon exiting scope
+  save_output(host_data(output_file, y_vec), (size_t)N*K*P*Q);
 
   #ifdef DEBUG // only run the sequential convolution if debugging
-  compare(cpu_convolution(), y_vec); 
+  compare(cpu_convolution(), host_data(output_file, y_vec)); 
   #endif
 }
 
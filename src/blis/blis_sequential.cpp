@@ -4,73 +4,356 @@
  * 
  * Implements the gemm-based convolution algorithm in forward propagation mode.
  * Reduces the memory consumption avoiding the im2col step.
+ *
+ * Compiled with -DTHREADED (blis_threaded target), the batch and the jc, ic 
+ * and jr loops are distributed among OpenMP threads.
  */
 
 #include "../utils.hpp"
 
+#if defined(__x86_64__) && !defined(__SYCL_DEVICE_ONLY__)
+  #include <immintrin.h>
+#endif
+
+#ifdef THREADED
+  #include <omp.h>
+#endif
+
+// Blocking: set by select_micro_kernel() (MR, NR) and select_blocking()
+// (KC, NC, MC) before every convolution
 int 
-  KC = 512,  //(C*R*S)/2, //368,
-  NC = 6144, //(P*Q)/2,   //3072,
-  MC = 96,   //K/2,       //560,
-  NR = 12,   //NC/2,
-  MR = 8;    //MC/2;
+  KC = 512,
+  NC = 6144,
+  MC = 96,
+  NR = 12,
+  MR = 8;
 
 int CHW=C*H*W, HW=H*W, RS=R*S, PQ=P*Q;
 
+// Offset in x of every row (c,r,s) of im2col(x): c*HW + r*W + s
+std::vector<int> row_offsets;
+
 /**
- * Performs a simple matrix multiplication.
+ * Signature of the micro-kernels: C[MR×NR] += A[MR×kc] · B[kc×NR], reading
+ * A and B from packed micro-panels and C with leading dimension ldc.
  */
-void matmul(float *C, float *A, float *B, int M, int N, int K, int ldb, int ldc) {
+typedef void (*micro_kernel_t)(int kc, float *A, float *B, float *C, int ldc);
 
-  for (int m = 0; m < M; m++) {
-    for (int k = 0; k < K; k++) {
-      for (int n = 0; n < N; n++) {
-        C[m*ldc+n] += A[m*K+k] * B[k*ldb+n];
+/**
+ * Portable micro-kernel, used when the CPU has no AVX2/AVX-512.
+ */
+template <int mr, int nr>
+void micro_kernel_generic(int kc, float *A, float *B, float *C, int ldc) {
+
+  float C_reg[mr][nr] = {};
+
+  for (int k = 0; k < kc; k++) {
+    for (int i = 0; i < mr; i++) {
+      for (int j = 0; j < nr; j++) {
+        C_reg[i][j] += A[k*mr+i] * B[k*nr+j];
+      }
+    }
+  }
+
+  for (int i = 0; i < mr; i++) {
+    for (int j = 0; j < nr; j++) {
+      C[i*ldc+j] += C_reg[i][j];
+    }
+  }
+}
+
+#if defined(__x86_64__) && !defined(__SYCL_DEVICE_ONLY__)
+
+/**
+ * 6×16 micro-kernel: keeps C in 12 ymm registers and, for each k, loads 
+ * one row of B in two registers and broadcasts the six elements of A.
+ */
+__attribute__((target("avx2,fma")))
+void micro_kernel_avx2(int kc, float *A, float *B, float *C, int ldc) {
+
+  __m256 C_reg[6][2];
+  for (int i = 0; i < 6; i++) {
+    C_reg[i][0] = _mm256_loadu_ps(&C[i*ldc]);
+    C_reg[i][1] = _mm256_loadu_ps(&C[i*ldc+8]);
+  }
+
+  for (int k = 0; k < kc; k++, A += 6, B += 16) {
+    __m256 B0 = _mm256_loadu_ps(&B[0]);
+    __m256 B1 = _mm256_loadu_ps(&B[8]);
+
+    for (int i = 0; i < 6; i++) {
+      __m256 Ai = _mm256_broadcast_ss(&A[i]);
+      C_reg[i][0] = _mm256_fmadd_ps(Ai, B0, C_reg[i][0]);
+      C_reg[i][1] = _mm256_fmadd_ps(Ai, B1, C_reg[i][1]);
+    }
+  }
+
+  for (int i = 0; i < 6; i++) {
+    _mm256_storeu_ps(&C[i*ldc],   C_reg[i][0]);
+    _mm256_storeu_ps(&C[i*ldc+8], C_reg[i][1]);
+  }
+}
+
+/**
+ * 8×32 micro-kernel: keeps C in 16 zmm registers and, for each k, loads 
+ * one row of B in two registers and broadcasts the eight elements of A.
+ */
+__attribute__((target("avx512f")))
+void micro_kernel_avx512(int kc, float *A, float *B, float *C, int ldc) {
+
+  __m512 C_reg[8][2];
+  for (int i = 0; i < 8; i++) {
+    C_reg[i][0] = _mm512_loadu_ps(&C[i*ldc]);
+    C_reg[i][1] = _mm512_loadu_ps(&C[i*ldc+16]);
+  }
+
+  for (int k = 0; k < kc; k++, A += 8, B += 32) {
+    __m512 B0 = _mm512_loadu_ps(&B[0]);
+    __m512 B1 = _mm512_loadu_ps(&B[16]);
+
+    for (int i = 0; i < 8; i++) {
+      __m512 Ai = _mm512_set1_ps(A[i]);
+      C_reg[i][0] = _mm512_fmadd_ps(Ai, B0, C_reg[i][0]);
+      C_reg[i][1] = _mm512_fmadd_ps(Ai, B1, C_reg[i][1]);
+    }
+  }
+
+  for (int i = 0; i < 8; i++) {
+    _mm512_storeu_ps(&C[i*ldc],    C_reg[i][0]);
+    _mm512_storeu_ps(&C[i*ldc+16], C_reg[i][1]);
+  }
+}
+
+#endif
+
+micro_kernel_t micro_kernel = micro_kernel_generic<8,12>;
+
+/**
+ * Picks the widest micro-kernel supported by the CPU and sets MR and NR 
+ * to its register block size. MC and NC are multiples of all of them.
+ */
+void select_micro_kernel() {
+
+  #if defined(__x86_64__) && !defined(__SYCL_DEVICE_ONLY__)
+  if (__builtin_cpu_supports("avx512f")) {
+    micro_kernel = micro_kernel_avx512; MR = 8; NR = 32;
+    return;
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    micro_kernel = micro_kernel_avx2; MR = 6; NR = 16;
+    return;
+  }
+  #endif
+
+  micro_kernel = micro_kernel_generic<8,12>; MR = 8; NR = 12;
+}
+
+/**
+ * KC, NC and MC of a blocking
+ */
+struct blocking_t {
+  int KC, NC, MC;
+};
+
+// Blocking set by the sweep, used instead of the saved or derived one
+blocking_t forced_blocking = { 0, 0, 0 };
+
+/**
+ * Derives the blocking from the caches of the core with the analytical
+ * model of BLIS, for the MR×NR micro-kernel:
+ *   - KC, so that a micro-panel of B, KC×NR, stays in L1 while the
+ *     micro-panels of A stream through the ways left,
+ *   - MC, so that the block of A, MC×KC, fills L2 but two ways,
+ *   - NC, so that the panel of B, KC×NC, fills L3 but two ways, or its
+ *     share of a thread when threaded.
+ * MC and NC are rounded down to multiples of MR and NR, and to the rows and
+ * columns of the product.
+ */
+blocking_t derive_blocking() {
+
+  cache_level_t L1 = cache_level(1), L2 = cache_level(2), L3 = cache_level(3);
+  if (!L1.size) L1 = { 32 << 10, 8, 64 };
+  if (!L2.size) L2 = { 256 << 10, 4, 64 };
+  if (!L3.size) L3 = { L2.size * 4, L2.ways, L2.line };
+
+  // Ways of L1 for A, as in BLIS: C_Ar = (W_L1 - 1) / (1 + NR/MR)
+  int ways_A = std::max(1, (int)((L1.ways - 1) / (1 + (double)NR/MR)));
+  blocking_t blocking;
+
+  blocking.KC = ways_A * L1.sets() * L1.line / (MR * sizeof(float));
+  blocking.KC = std::max(blocking.KC, 64);
+
+  size_t L2_bytes = std::max(L2.ways - 2, 1) * L2.sets() * L2.line;
+  blocking.MC = L2_bytes / (blocking.KC * sizeof(float)) / MR * MR;
+  blocking.MC = std::max(blocking.MC, MR);
+
+  size_t L3_bytes = std::max(L3.ways - 2, 1) * L3.sets() * L3.line;
+  #ifdef THREADED
+  L3_bytes /= omp_get_max_threads();
+  #endif
+  blocking.NC = L3_bytes / (blocking.KC * sizeof(float)) / NR * NR;
+  blocking.NC = std::max(blocking.NC, NR);
+
+  blocking.MC = std::min(blocking.MC, (K + MR-1) / MR * MR);
+  blocking.NC = std::min(blocking.NC, (P*Q + NR-1) / NR * NR);
+
+  return blocking;
+}
+
+// Returns the path of the file of blockings saved by the sweep.
+const char *blocking_path() {
+  const char *path = std::getenv("BLIS_BLOCKING_CACHE");
+  return path ? path : "blis_blocking.csv";
+}
+
+/**
+ * Returns the key of the current shape in the file of blockings: the
+ * executable, the sizes of the caches, the micro-kernel and the dimensions,
+ * so that machines with different caches can share the file.
+ */
+std::string blocking_key() {
+
+  #ifndef THREADED
+  std::string key = "blis_sequential,";
+  #else
+  std::string key = "blis_threaded,";
+  #endif
+
+  for (int level = 1; level <= 3; level++) {
+    key += std::to_string(cache_level(level).size) + ",";
+  }
+  for (int dim : { MR,NR,N,C,K,H,W,R,S }) {
+    key += std::to_string(dim) + ",";
+  }
+  return key;
+}
+
+/**
+ * Sets KC, NC and MC: the blocking forced by the sweep, or the one saved by
+ * a sweep of the shape on this machine, or the one derived from the caches.
+ */
+void select_blocking() {
+
+  blocking_t blocking = forced_blocking;
+
+  if (!blocking.KC) {
+    std::ifstream saved(blocking_path());
+    std::string key = blocking_key(), line;
+    blocking = derive_blocking();
+
+    // Lines are key,KC,NC,MC,time; later lines override earlier ones
+    while (std::getline(saved, line)) {
+      if (line.compare(0, key.size(), key) == 0) {
+        sscanf(line.c_str() + key.size(), "%d,%d,%d",
+               &blocking.KC, &blocking.NC, &blocking.MC);
       }
     }
   }
+
+  KC = blocking.KC; NC = blocking.NC; MC = blocking.MC;
+
+  #ifdef DEBUG
+  std::cout << "KC=" << KC << " NC=" << NC << " MC=" << MC
+            << " MR=" << MR << " NR=" << NR << ": ";
+  #endif
+}
+
+/**
+ * Computes an edge tile of mr×nr elements (mr <= MR, nr <= NR) through a 
+ * full MR×NR tile in scratch memory. The packed panels are zero-padded, 
+ * so only the copy of the valid elements back to C is scalar.
+ */
+void micro_kernel_edge(int kc, float *A, float *B, float *C, int ldc, 
+                       int mr, int nr) {
+
+  float C_tmp[8*32] = {}; // largest MR×NR
+  micro_kernel(kc, A, B, C_tmp, NR);
+
+  for (int i = 0; i < mr; i++) {
+    for (int j = 0; j < nr; j++) {
+      C[i*ldc+j] += C_tmp[i*NR+j];
+    }
+  }
+}
+
+/**
+ * Applies the epilogue to a tile of mr×nr elements at row i0 and column j0
+ * of C, once its last block of kc has been accumulated and while it is still
+ * in cache. y_off is the position of C in the output tensor.
+ */
+void epilogue_tile(float *C, int ldc, int mr, int nr, int i0, int j0,
+                   float *bias, float *residual, size_t y_off) {
+
+  for (int i = 0; i < mr; i++) {
+    for (int j = 0; j < nr; j++) {
+      size_t y_idx = y_off + (size_t)(i0+i)*ldc + j0+j;
+      C[i*ldc+j] = epilogue.apply(C[i*ldc+j], bias, residual, i0+i, y_idx);
+    }
+  }
 }
 
 /** 
- * Packs a block of matrix A into the buffer A_pack.
+ * Packs a block of matrix A into the buffer A_pack as micro-panels of
+ * MR rows stored column by column. Rows beyond M are padded with zeros.
  */
 void pack_A(float *A_pack, float *A, int lda, int M, int K) {
-  
-  for (int m = 0; m < M; m++) {
+
+  PERF_REGION("pack_A");
+  for (int ir = 0; ir < M; ir += MR) {
     for (int k = 0; k < K; k++) {
-      A_pack[m*K+k] = A[m*lda+k];
+      for (int i = 0; i < MR; i++) {
+        A_pack[ir*K + k*MR + i] = (ir+i < M) ? A[(ir+i)*lda+k] : 0;
+      }
     }
   }
 }
 
 /**
- * Packs a block of matrix B into the buffer B_pack 
- * doing the im2col.
+ * Packs a block of matrix B into the buffer B_pack doing the im2col, as
+ * micro-panels of NR columns stored row by row. Columns beyond nc are 
+ * padded with zeros.
+ *
+ * The offset in x of row pc+ps, (c,r,s), comes from row_offsets, and the 
+ * columns are walked as runs of consecutive q, contiguous in x, copied 
+ * with memcpy up to the end of a micro-panel.
  */
 void pack_B(float *B_pack, float *B, int pc, int jc, int kc, int nc) {
 
+  PERF_REGION("pack_B");
+  int p0 = jc / Q, q0 = jc % Q;
+
   for (int ps = 0; ps < kc; ps++) {
-    int c =  (pc+ps)/RS;
-    int r = ((pc+ps)%RS)/R;
-    int s = ((pc+ps)%RS)%R;
+    float *B_row = &B[row_offsets[pc+ps]];
+    int p = p0, q = q0;
 
-    for (int js = 0; js < nc; js++) {
-  //  int n =  (jc+js)/PQ;
-      int p = ((jc+js)%PQ)/P;
-      int q = ((jc+js)%PQ)%P;
+    for (int js = 0; js < nc; ) {
+      int run = std::min(Q - q, nc - js); // columns left in the output row
+      int jr = js % NR;
+      int len = std::min(run, NR - jr);   // columns left in the micro-panel
+
+      std::memcpy(&B_pack[(js-jr)*kc + ps*NR + jr], &B_row[p*W + q], 
+                  len*sizeof(float));
+
+      js += len; q += len;
+      if (q == Q) { q = 0; p++; }
+    }
 
-      B_pack[ps*nc + js] = B[c*HW + (p+r)*W + (q+s)];
+    for (int js = nc; js % NR; js++) {
+      B_pack[(js/NR)*NR*kc + ps*NR + js%NR] = 0;
     }
   }
 }
 
+#ifndef THREADED
+
 /**
- * Matrix multiplication with implicit im2col.
+ * Matrix multiplication with implicit im2col, and the epilogue.
  */
-void blis(float *C, float *A, float *B, int m, int n, int k) {
+void blis(float *C, float *A, float *B, int m, int n, int k,
+          float *bias, float *residual, size_t y_off) {
 
-  float *A_pack = new float[MC*KC];
-  float *B_pack = new float[KC*NC];
+  // Reused from the arena for every image
+  arena_buffer_t<float> A_pack((size_t)MC*KC), B_pack((size_t)KC*NC);
 
   int lda = k;
   int ldc = n;
@@ -89,6 +372,7 @@ void blis(float *C, float *A, float *B, int m, int n, int k) {
         pack_A(A_pack, &A[ic*lda + pc], lda, mc, kc); // PACK A
         float *C_pack = &C[ic*ldc + jc];
 
+        PERF_REGION("micro-kernel", 2.0*mc*nc*kc);
         for (int jr = 0; jr < nc; jr += NR) {
           int nr = fmin(NR, nc-jr);
 
@@ -96,42 +380,317 @@ void blis(float *C, float *A, float *B, int m, int n, int k) {
             int mr = fmin(MR, mc-ir);
               
             float *Ar = &A_pack[ir*kc];
-            float *Br = &B_pack[jr];
+            float *Br = &B_pack[jr*kc];
             float *Cr = &C_pack[ir*ldc + jr];
 
-            matmul(Cr, Ar, Br, mr, nr, kc, nc, ldc);
+            if (mr == MR && nr == NR) {
+              micro_kernel(kc, Ar, Br, Cr, ldc);
+            } else {
+              micro_kernel_edge(kc, Ar, Br, Cr, ldc, mr, nr);
+            }
+
+            if (pc+kc == k && epilogue.enabled()) {
+              epilogue_tile(Cr, ldc, mr, nr, ic+ir, jc+jr, 
+                            bias, residual, y_off);
+            }
           }
         }
       }
     }
   }
+}
+
+#else // THREADED
+
+/**
+ * Returns the largest divisor of threads that is not greater than work, 
+ * i.e. in how many ways a loop of work iterations is split among threads.
+ */
+int ways(int threads, int work) {
+  for (int w = fmin(threads, work); w > 1; w--) {
+    if (threads % w == 0) return w;
+  }
+  return 1;
+}
+
+/**
+ * Matrix multiplication with implicit im2col, distributed among threads as
+ * BLIS does: jc_ways teams split the jc loop, each one with its own B_pack
+ * that all of its threads pack and then share. Within a team, the ic loop 
+ * is split in ic_ways and the jr loop in jr_ways, and every thread packs 
+ * its block of A into its own A_pack. With node ≥ 0, all the threads are
+ * pinned to the CPUs of that NUMA node.
+ */
+void blis(float *C, float *A, float *B, int m, int n, int k, 
+          float *bias, float *residual, size_t y_off,
+          float *B_packs, float *A_packs, int jc_ways, int ic_ways, int jr_ways,
+          int node) {
 
-  delete [] A_pack;
-  delete [] B_pack;
+  int lda = k;
+  int ldc = n;
+
+  #pragma omp parallel num_threads(jc_ways)
+  {
+    int jc_id = omp_get_thread_num();
+    float *B_pack = &B_packs[jc_id*KC*NC];
+    if (node >= 0) numa_pin(node);
+
+    for (int jc = jc_id*NC; jc < n; jc += jc_ways*NC) {
+      int nc = fmin(NC, n-jc);
+      int panels = (nc+NR-1)/NR;
+
+      #pragma omp parallel num_threads(ic_ways*jr_ways)
+      {
+        int tid = omp_get_thread_num();
+        int ic_id = tid / jr_ways;
+        int jr_id = tid % jr_ways;
+        float *A_pack = &A_packs[(jc_id*ic_ways*jr_ways + tid)*MC*KC];
+        if (node >= 0) numa_pin(node);
+
+        for (int pc = 0; pc < k; pc += KC) {
+          int kc = fmin(KC, k-pc);
+
+          // Every thread packs a range of micro-panels of the shared B_pack
+          int first = panels * tid / (ic_ways*jr_ways);
+          int last = panels * (tid+1) / (ic_ways*jr_ways);
+          if (first < last) {
+            int js = first*NR;
+            pack_B(&B_pack[js*kc], B, pc, jc+js, kc, fmin(last*NR, nc)-js);
+          }
+          #pragma omp barrier
+
+          for (int ic = ic_id*MC; ic < m; ic += ic_ways*MC) {
+            int mc = fmin(MC, m-ic);
+
+            pack_A(A_pack, &A[ic*lda + pc], lda, mc, kc); // PACK A
+            float *C_pack = &C[ic*ldc + jc];
+
+            // The thread computes about 1/jr_ways of the columns
+            PERF_REGION("micro-kernel", 2.0*mc*nc*kc/jr_ways);
+            for (int jr = jr_id*NR; jr < nc; jr += jr_ways*NR) {
+              int nr = fmin(NR, nc-jr);
+
+              for (int ir = 0; ir < mc; ir += MR) {
+                int mr = fmin(MR, mc-ir);
+
+                float *Ar = &A_pack[ir*kc];
+                float *Br = &B_pack[jr*kc];
+                float *Cr = &C_pack[ir*ldc + jr];
+
+                if (mr == MR && nr == NR) {
+                  micro_kernel(kc, Ar, Br, Cr, ldc);
+                } else {
+                  micro_kernel_edge(kc, Ar, Br, Cr, ldc, mr, nr);
+                }
+
+                if (pc+kc == k && epilogue.enabled()) {
+                  epilogue_tile(Cr, ldc, mr, nr, ic+ir, jc+jr, 
+                                bias, residual, y_off);
+                }
+              }
+            }
+          }
+
+          // B_pack is overwritten in the next iteration
+          #pragma omp barrier
+        }
+      }
+    }
+  }
 }
 
+#endif
+
 /**
  * im2col transformation + matrix multiplication
  */
 void convolution() {
 
-  std::vector<float> x_vec(N*C*H*W);
-  std::vector<float> f_vec(K*C*R*S);
-  std::vector<float> y_vec(N*K*P*Q);
+  // The tensors of the files in nchw are used in place and get no vectors,
+  // the others take theirs from the arena
+  arena_vector_t<float> x_vec(
+    in_place(input_file, N, C, H, W) ? 0 : N*C*H*W);
+  arena_vector_t<float> f_vec(
+    in_place(filters_file, K, C, R, S) ? 0 : K*C*R*S);
+  arena_vector_t<float> y_vec(
+    in_place(output_file, N, K, P, Q) ? 0 : N*K*P*Q);
+  std::vector<float> bias_vec, residual_vec;
 
   init_data(x_vec, f_vec, y_vec);
+  init_epilogue(bias_vec, residual_vec);
+
+  float *x = host_data(input_file, x_vec);
+  float *f = host_data(filters_file, f_vec);
+  float *y = host_data(output_file, y_vec);
+  if (y_vec.empty()) std::fill(y, y + (size_t)N*K*P*Q, 0.f);
 
   CHW=C*H*W; HW=H*W; RS=R*S; PQ=P*Q;
+  row_offsets.resize(C*R*S);
+  for (int c = 0; c < C; c++) {
+    for (int r = 0; r < R; r++) {
+      for (int s = 0; s < S; s++) {
+        row_offsets[(c*R + r)*S + s] = c*HW + r*W + s;
+      }
+    }
+  }
+  select_micro_kernel();
+  select_blocking();
+
+  #ifndef THREADED
+
+  compute_begin();
   for (int n = 0; n < N; n++) {
-    blis(&y_vec[n*K*P*Q], f_vec.data(), &x_vec[n*C*H*W], K, P*Q, C*R*S);
+    blis(&y[(size_t)n*K*P*Q], f, &x[(size_t)n*C*H*W], K, P*Q, C*R*S,
+         bias_vec.data(), residual_vec.data(), (size_t)n*K*P*Q);
+  }
+  compute_end();
+
+  #else // THREADED
+
+  // Split the threads among the images of the batch first, then among the
+  // jc, ic and jr loops of each image. With --numa, the batch teams are 
+  // spread evenly over the nodes.
+  int threads = omp_get_max_threads();
+  int nodes = numa_mode 
+            ? std::min<int>({ (int)numa_nodes().size(), N, threads }) : 1;
+  int batch_ways = nodes * ways(threads/nodes, N/nodes);
+  int jc_ways = ways(threads/batch_ways, (P*Q+NC-1)/NC);
+  int ic_ways = ways(threads/batch_ways/jc_ways, (K+MC-1)/MC);
+  int jr_ways = threads/batch_ways/jc_ways/ic_ways;
+  int team = jc_ways*ic_ways*jr_ways;
+  omp_set_max_active_levels(3);
+
+  // One B_pack per jc team and one A_pack per thread, reused for all images
+  // and, from the arena, for the next calls
+  arena_buffer_t<float> B_packs((size_t)batch_ways*jc_ways*KC*NC);
+  arena_buffer_t<float> A_packs((size_t)batch_ways*team*MC*KC);
+
+  // With --numa, the images of a batch team, their outputs and residuals, 
+  // and the packs of the team are moved to its node
+  for (int b = 0; numa_mode && b < batch_ways; b++) {
+    int node = b * nodes / batch_ways;
+    size_t n0 = (size_t)b*N/batch_ways;
+    size_t images = (size_t)(b+1)*N/batch_ways - n0;
+    numa_bind(&x[n0*C*H*W], images*C*H*W*sizeof(float), node);
+    numa_bind(&y[n0*K*P*Q], images*K*P*Q*sizeof(float), node);
+    if (epilogue.has_residual)
+      numa_bind(&residual_vec[n0*K*P*Q], images*K*P*Q*sizeof(float), node);
+    numa_bind(&B_packs[b*jc_ways*KC*NC], jc_ways*KC*NC*sizeof(float), node);
+    numa_bind(&A_packs[b*team*MC*KC], team*MC*KC*sizeof(float), node);
+  }
+
+  // With --numa, every thread of the nested teams is pinned to the node of
+  // its batch team once, out of the timed region. numa_pin() skips the 
+  // threads already pinned, so its calls below only cost a check, unless
+  // the runtime brings new threads into the teams
+  if (numa_mode) {
+    #pragma omp parallel num_threads(batch_ways)
+    {
+      int node = omp_get_thread_num() * nodes / batch_ways;
+      numa_pin(node);
+
+      #pragma omp parallel num_threads(jc_ways)
+      {
+        numa_pin(node);
+
+        #pragma omp parallel num_threads(ic_ways*jr_ways)
+        numa_pin(node);
+      }
+    }
+  }
+
+  compute_begin();
+  #pragma omp parallel num_threads(batch_ways)
+  {
+    int b = omp_get_thread_num();
+    int node = numa_mode ? b * nodes / batch_ways : -1;
+
+    for (int n = b*N/batch_ways; n < (b+1)*N/batch_ways; n++) {
+      blis(&y[(size_t)n*K*P*Q], f, &x[(size_t)n*C*H*W], K, P*Q, C*R*S,
+           bias_vec.data(), residual_vec.data(), (size_t)n*K*P*Q,
+           &B_packs[b*jc_ways*KC*NC], &A_packs[b*team*MC*KC], 
+           jc_ways, ic_ways, jr_ways, node);
+    }
+  }
+  compute_end();
+
+  #ifdef DEBUG
+  if (numa_mode) {
+    numa_report("x", x, (size_t)N*C*H*W*sizeof(float));
+    numa_report("y", y, (size_t)N*K*P*Q*sizeof(float));
   }
+  #endif
+
+  #endif
+
+  save_output(y, (size_t)N*K*P*Q);
 
   #ifdef DEBUG // only run the sequential convolution if debugging
-  compare(cpu_convolution(), y_vec); 
+  compare(cpu_convolution(), y); 
   #endif
 }
 
+// Untimed and timed runs of every blocking when sweeping a shape
+constexpr int SWEEP_WARMUP = 1, SWEEP_REPS = 5;
+
+/**
+ * Times the convolution of the shape with the blockings around the derived
+ * one, halving and doubling each of KC, MC and NC, and appends the fastest
+ * one to the file of blockings, where select_blocking() finds it. Each 
+ * blocking runs SWEEP_WARMUP times untimed, then SWEEP_REPS times, and is
+ * ranked by its median time. Prints KC,NC,MC,time for every blocking.
+ */
+void sweep_blocking(dnnl::engine::kind engine_kind) {
+
+  select_micro_kernel();
+  blocking_t derived = derive_blocking(), best = derived;
+  double best_time = INFINITY;
+
+  for (int kc : { derived.KC/2, derived.KC, derived.KC*2 }) {
+    for (int mc : { derived.MC/2, derived.MC, derived.MC*2 }) {
+      for (int nc : { derived.NC/2, derived.NC, derived.NC*2 }) {
+
+        forced_blocking = { kc, std::max(nc/NR*NR, NR), 
+                                std::max(mc/MR*MR, MR) };
+
+        std::vector<double> times;
+        for (int i = 0; i < SWEEP_WARMUP + SWEEP_REPS; i++) {
+          if (handle_errors(engine_kind, convolution)) break;
+          if (i >= SWEEP_WARMUP) times.push_back(compute_time);
+        }
+        if (times.size() < SWEEP_REPS) continue;
+
+        std::sort(times.begin(), times.end());
+        double median = times[(SWEEP_REPS-1) / 2];
+
+        std::cout << forced_blocking.KC << "," << forced_blocking.NC << ","
+                  << forced_blocking.MC << "," << median << std::endl;
+
+        if (median < best_time) {
+          best = forced_blocking;
+          best_time = median;
+        }
+      }
+    }
+  }
+
+  forced_blocking = { 0, 0, 0 };
+
+  // Nothing to save if no blocking could run
+  if (best_time == INFINITY)
+    throw std::runtime_error("the convolution failed with every blocking");
+
+  std::ofstream saved(blocking_path(), std::ios::app);
+  saved << blocking_key() << best.KC << "," << best.NC << "," << best.MC
+        << "," << best_time << "\n";
+}
+
 int main(int argc, char **argv) {
+
+  // --sweep searches the blocking of the shape instead of running it once
+  if (parse_flag(argc, argv, "--sweep")) {
+    return handle_errors(parse_arguments(argc,argv), sweep_blocking);
+  }
   return handle_errors(parse_arguments(argc,argv), convolution);
 }
 
@@ -0,0 +1,163 @@
+/**
+ * direct_blocked.cpp
+ * 
+ * Implements the direct convolution algorithm in forward propagation mode on
+ * channel-blocked tensors: the activations in nChw8c or nChw16c and the 
+ * filters in blocks of BLOCK input × BLOCK output channels. Compile with 
+ * -DBLOCK=8 or -DBLOCK=16 to choose the block size.
+ */
+
+#include "../utils.hpp"
+
+#ifndef BLOCK
+  #define BLOCK 8
+#endif
+
+#if BLOCK == 8
+  constexpr layout_t LAYOUT = layout_t::nChw8c;
+#elif BLOCK == 16
+  constexpr layout_t LAYOUT = layout_t::nChw16c;
+#else
+  #error "BLOCK must be 8 or 16"
+#endif
+
+int CB, KB; // blocks of input and output channels
+
+/**
+ * Reorders the filters from KCRS to [K/BLOCK][C/BLOCK][R][S][BLOCK][BLOCK],
+ * output channels innermost, padding the last blocks with zeros.
+ */
+void filter_reorder(float *f_blk, float *f) {
+
+  std::fill(f_blk, f_blk + KB*CB*R*S*BLOCK*BLOCK, 0.f);
+
+  for (int k = 0; k < K; k++)
+    for (int c = 0; c < C; c++)
+      for (int r = 0; r < R; r++)
+        for (int s = 0; s < S; s++)
+          f_blk[(((((k/BLOCK)*CB + c/BLOCK)*R + r)*S + s)*BLOCK 
+            + c%BLOCK)*BLOCK + k%BLOCK] = f[((k*C + c)*R + r)*S + s];
+}
+
+/**
+ * Convolution y += x * f with all the tensors blocked. For every input
+ * channel of a block, the BLOCK output channels of a pixel are updated
+ * with a single vector multiply-add. The epilogue is applied to each row
+ * of the output once it is complete, while it is still in cache.
+ */
+void direct_blocked(float *x, float *f, float *y, 
+                    float *bias, float *residual) {
+
+  for (int n = 0; n < N; n++) {
+    for (int kb = 0; kb < KB; kb++) {
+      for (int p = 0; p < P; p++) {
+        size_t y_off = (((size_t)n*KB + kb)*P + p)*Q*BLOCK;
+        float *y_row = &y[y_off];
+
+        for (int cb = 0; cb < CB; cb++) {
+          for (int r = 0; r < R; r++) {
+            float *x_row = &x[(((size_t)n*CB + cb)*H + p+r)*W*BLOCK];
+
+            for (int s = 0; s < S; s++) {
+              float *f_rs = &f[(((kb*CB + cb)*R + r)*S + s)*BLOCK*BLOCK];
+
+              for (int q = 0; q < Q; q++) {
+                float *x_pix = &x_row[(q+s)*BLOCK];
+                float *y_pix = &y_row[q*BLOCK];
+
+                for (int ci = 0; ci < BLOCK; ci++) {
+                  for (int ko = 0; ko < BLOCK; ko++) {
+                    y_pix[ko] += x_pix[ci] * f_rs[ci*BLOCK + ko];
+                  }
+                }
+              }
+            }
+          }
+        }
+
+        // The padding channels of the last block stay zero
+        if (epilogue.enabled()) {
+          int valid = std::min(BLOCK, K - kb*BLOCK);
+          for (int q = 0; q < Q; q++) {
+            for (int ko = 0; ko < valid; ko++) {
+              y_row[q*BLOCK + ko] = epilogue.apply(y_row[q*BLOCK + ko], 
+                bias, residual, kb*BLOCK + ko, y_off + q*BLOCK + ko);
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+/**
+ * Perform convolution on host. The input is reordered to the blocked layout
+ * before the compute region, as a network would keep its activations in it.
+ */
+void convolution() {
+
+  tensor_desc_t x_desc = { N,C,H,W,LAYOUT };
+  tensor_desc_t y_desc = { N,K,P,Q,LAYOUT };
+
+  CB = x_desc.padded_c() / BLOCK;
+  KB = y_desc.padded_c() / BLOCK;
+
+  arena_vector_t<float> x_vec(N*C*H*W);
+  arena_vector_t<float> f_vec(K*C*R*S);
+  arena_vector_t<float> y_vec(N*K*P*Q);
+  std::vector<float> bias_vec, residual_vec;
+
+  init_data(x_vec, f_vec, y_vec);
+  init_epilogue(bias_vec, residual_vec);
+
+  // The blocked tensors, which the kernel works on, from the arena
+  arena_vector_t<float> x_blk(x_desc.size());
+  arena_vector_t<float> f_blk(KB*CB*R*S*BLOCK*BLOCK);
+  arena_vector_t<float> y_blk(y_desc.size(), 0);
+
+  tensor_desc_t x_nchw = { N,C,H,W,layout_t::nchw };
+  tensor_desc_t y_nchw = { N,K,P,Q,layout_t::nchw };
+  reorder_tensor(x_vec.data(), x_nchw, x_blk.data(), x_desc);
+  filter_reorder(f_blk.data(), f_vec.data());
+
+  // The residual is added in the layout of the output
+  arena_vector_t<float> residual_blk(residual_vec.begin(), 
+                                     residual_vec.end());
+  if (epilogue.has_residual) {
+    residual_blk.resize(y_desc.size());
+    reorder_tensor(residual_vec.data(), y_nchw, residual_blk.data(), y_desc);
+  }
+
+  compute_begin();
+  direct_blocked(x_blk.data(), f_blk.data(), y_blk.data(),
+                 bias_vec.data(), residual_blk.data());
+  compute_end();
+
+  if (output_file) {
+    reorder_tensor(y_blk.data(), y_desc, y_vec.data(), y_nchw);
+    save_output(y_vec);
+  }
+
+  #ifdef DEBUG // only run the sequential convolution if debugging
+  reorder_tensor(y_blk.data(), y_desc, y_vec.data(), y_nchw);
+  compare(cpu_convolution(), y_vec);
+  #endif
+}
+
+int main(int argc, char **argv) {
+  return handle_errors(parse_arguments(argc,argv), convolution);
+}
+
+//    Copyright 2021 Sara Aguado Couselo
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
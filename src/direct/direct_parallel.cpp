@@ -8,6 +8,14 @@
 #include "../utils.hpp"
 #include "dpc_common.hpp"
 
+/**
+ * Tiling of the kernel: each work-item computes KB output channels of QB
+ * output columns of a row, and a work-group of lk×LP×LQ work-items shares
+ * a halo tile of the input and the filters of its lk·KB channels in local
+ * memory, one input channel at a time.
+ */
+constexpr int KB = 4, QB = 4, LP = 4, LQ = 8;
+
 /**
  * Struct to pass the dimensions to the kernel
  */
@@ -16,80 +24,309 @@ struct constants_t {
   int hw,rs,pq,chw,crs,kpq; // precomputed variables
 };
 
+/**
+ * Submits the convolution kernel, y = x * f, of a batch of images to the
+ * command group. The tensors are accessors in the buffer mode and device 
+ * pointers in the USM mode.
+ */
+template <class X, class F, class Y, class Bias, class Residual, class Args>
+void submit_convolution(sycl::handler &context, int batch, X x, F f, Y y, 
+                        Bias bias, Residual residual, Args args) {
+
+  epilogue_t epi = epilogue; // globals are not accessible from the kernel
+
+  // Work-items along K: only one if a single block covers all the filters
+  const int lk = K <= KB ? 1 : 2;
+  const int TK = lk*KB, TP = LP, TQ = LQ*QB;    // output tile
+  const int TH = TP+R-1, TW = TQ+S-1;           // input tile
+  const int groups_k = (K + TK-1) / TK;
+  const int groups_p = (P + TP-1) / TP;
+  const int groups_q = (Q + TQ-1) / TQ;
+
+  // Input halo tile and filters of one channel in local memory
+  sycl::accessor<float, 1, sycl::access::mode::read_write, 
+    sycl::access::target::local> x_tile(sycl::range(TH*TW), context);
+  sycl::accessor<float, 1, sycl::access::mode::read_write, 
+    sycl::access::target::local> f_tile(sycl::range(TK*R*S), context);
+
+  // Execute kernel
+  context.parallel_for(sycl::nd_range(
+    sycl::range(batch*groups_k*lk, groups_p*LP, groups_q*LQ),
+    sycl::range(lk, LP, LQ)
+  ), [=](sycl::nd_item<3> item) {
+    
+    auto arg = args[0];
+    int li = item.get_local_id(0);
+    int lp = item.get_local_id(1);
+    int lq = item.get_local_id(2);
+    int tid = item.get_local_linear_id();
+    int size = lk*LP*LQ;
+
+    int n  = item.get_group(0) / groups_k;
+    int k0 = item.get_group(0) % groups_k * TK;
+    int p0 = item.get_group(1) * TP;
+    int q0 = item.get_group(2) * TQ;
+    int p  = p0 + lp;
+
+    float acc[KB][QB] = {};
+
+    for (int c = 0; c < arg.C; c++) {
+
+      int x_off = n*arg.chw + c*arg.hw;
+      int f_off = c*arg.rs;
+
+      // Stage the input rows and columns needed by the output tile
+      for (int e = tid; e < TH*TW; e += size) {
+        int h = p0 + e / TW;
+        int w = q0 + e % TW;
+        x_tile[e] = (h < arg.H && w < arg.W) ? x[x_off + h*arg.W + w] : 0;
+      }
+
+      // Stage the filters of the output channels of the work-group
+      for (int e = tid; e < TK*arg.rs; e += size) {
+        int k = k0 + e / arg.rs;
+        f_tile[e] = k < arg.K ? f[k*arg.crs + f_off + e % arg.rs] : 0;
+      }
+
+      item.barrier(sycl::access::fence_space::local_space);
+
+      for (int r = 0; r < arg.R; r++) {
+        for (int s = 0; s < arg.S; s++) {
+
+          float xv[QB];
+          for (int j = 0; j < QB; j++) {
+            xv[j] = x_tile[(lp+r)*TW + lq + j*LQ + s];
+          }
+
+          for (int i = 0; i < KB; i++) {
+            float fv = f_tile[(li*KB + i)*arg.rs + r*arg.S + s];
+            for (int j = 0; j < QB; j++) {
+              acc[i][j] += fv * xv[j];
+            }
+          }
+        }
+      }
+
+      item.barrier(sycl::access::fence_space::local_space);
+    }
+
+    for (int i = 0; i < KB; i++) {
+      int k = k0 + li*KB + i;
+      for (int j = 0; j < QB; j++) {
+        int q = q0 + lq + j*LQ;
+        if (k < arg.K && p < arg.P && q < arg.Q) {
+          int y_off = n*arg.kpq + k*arg.pq + p*arg.Q + q;
+          y[y_off] = epi.apply(acc[i][j], bias, residual, k, y_off);
+        }
+      }
+    }
+  });
+}
+
+#ifdef USM
+
+// Device memory, reused across calls
+usm_array_t<float> x_dev, f_dev, y_dev, bias_dev, residual_dev;
+usm_array_t<constants_t> args_dev;
+// Pinned host slots of the micro-batches, reused across calls
+staging_t x_stage, y_stage, residual_stage;
+
+#endif
+
 /**
  * Perform convolution on device. Uses the dnnl engine_kind only to parse the 
  * dpc++ device selector.
+ *
+ * Compiled with -DUSM (direct_parallel_usm target), the tensors live in 
+ * device memory allocated once with malloc_device, on a queue also created
+ * once, and are moved with explicit memcpy, timed in transfer_time. With
+ * --micro-batch, the batch is streamed through them with stream_batches().
  */
 void convolution(dnnl::engine::kind engine_kind) {
 
   constants_t constants = { N,C,K,H,W,R,S,P,Q,H*W,R*S,P*Q,C*H*W,C*R*S,K*P*Q };
 
-  std::vector<float> x_vec(N*C*H*W);
-  std::vector<float> f_vec(K*C*R*S);
-  std::vector<float> y_vec(N*K*P*Q);
+  // The USM engines use the tensors of the files in place, if they can, and
+  // give them no vectors
+  #ifdef USM
+  bool mapped = true;
+  #else
+  bool mapped = false;
+  #endif
+  std::vector<float> x_vec(mapped && in_place(input_file, N, C, H, W) 
+                           ? 0 : (size_t)N*C*H*W);
+  std::vector<float> f_vec(mapped && in_place(filters_file, K, C, R, S) 
+                           ? 0 : (size_t)K*C*R*S);
+  std::vector<float> y_vec(mapped && in_place(output_file, N, K, P, Q) 
+                           ? 0 : (size_t)N*K*P*Q);
+  std::vector<float> bias_vec, residual_vec;
 
   init_data(x_vec, f_vec, y_vec);
+  init_epilogue(bias_vec, residual_vec);
+  numa_spread(engine_kind, x_vec, y_vec);
+
+  #ifndef USM
 
   {
     
     // Initialize the device queue with the custom selector. The device queue is
     // used to enqueue kernels. It encapsulates all states needed for execution.
     sycl::queue device_queue(
-      select_device(engine_kind), dpc_common::exception_handler
+      select_device(engine_kind), dpc_common::exception_handler, 
+      queue_properties()
     );
     
     #ifdef DEBUG
     std::cout << device_queue.get_device().get_info<sycl::info::device::name>();
     #endif
 
-    // Create buffers for tensors, buffer c is bound with host memory y_vec
-    // Allocate DPC++ buffers for input and output memory objects
-    sycl::buffer x_buf(x_vec.data(), sycl::range(N*C*H*W));
-    sycl::buffer f_buf(f_vec.data(), sycl::range(K*C*R*S));
-    sycl::buffer y_buf(y_vec.data(), sycl::range(N*K*P*Q));
-    sycl::buffer args_buf(&constants, sycl::range(1));
+    // Create buffers for tensors. They are not bound to the host memory, but
+    // filled and read back with explicit copies, so that the profile reports
+    // every transfer
+    sycl::buffer<float, 1> x_buf{sycl::range<1>(x_vec.size())};
+    sycl::buffer<float, 1> f_buf{sycl::range<1>(f_vec.size())};
+    sycl::buffer<float, 1> y_buf{sycl::range<1>(y_vec.size())};
+    sycl::buffer<float, 1> bias_buf{sycl::range<1>(bias_vec.size())};
+    sycl::buffer<float, 1> residual_buf{sycl::range<1>(residual_vec.size())};
+    sycl::buffer<constants_t, 1> args_buf{sycl::range<1>(1)};
+
+    compute_begin();
+
+    copy_to_buffer(device_queue, "x", x_vec.data(), x_buf);
+    copy_to_buffer(device_queue, "f", f_vec.data(), f_buf);
+    copy_to_buffer(device_queue, "bias", bias_vec.data(), bias_buf);
+    if (epilogue.has_residual) {
+      copy_to_buffer(device_queue, "residual", residual_vec.data(), 
+                     residual_buf);
+    }
+    copy_to_buffer(device_queue, "args", &constants, args_buf);
 
     // Submit command group to queue to perform convolution: y = x * f
-    device_queue.submit([&](sycl::handler &context) {
+    profile("kernel", "convolution", 
+            device_queue.submit([&](sycl::handler &context) {
 
       // Read from x and f, write to y
       sycl::accessor x(x_buf, context, sycl::read_only);
       sycl::accessor f(f_buf, context, sycl::read_only);
       sycl::accessor y(y_buf, context, sycl::write_only);
+      sycl::accessor bias(bias_buf, context, sycl::read_only);
+      sycl::accessor residual(residual_buf, context, sycl::read_only);
       sycl::accessor args(args_buf, context, sycl::read_only);
 
-      // Execute kernel
-      context.parallel_for(sycl::range(N,K,P*Q), [=](auto index) {
-        
-        auto arg = args[0];
-        int n = index[0];
-        int k = index[1];
-        int p = index[2] / arg.Q;
-        int q = index[2] % arg.Q;
-        int y_off = n*arg.kpq + k*arg.pq;
+      submit_convolution(context, N, x, f, y, bias, residual, args);
+    })).wait_and_throw();
 
-        for (int c = 0; c < arg.C; c++) {
+    compute_end();
 
-          int x_off = n*arg.chw + c*arg.hw;
-          int f_off = k*arg.crs + c*arg.rs;
+    // Read the output back, out of the compute region
+    copy_from_buffer(device_queue, "y", y_buf, y_vec.data()).wait();
 
-          for (int r = 0; r < arg.R; r++) {
-            for (int s = 0; s < arg.S; s++) {
+    write_profile(device_queue, "direct_parallel");
 
-              int h = p + r;
-              int w = q + s;
+  }
 
-              y[y_off + p*arg.Q+q] += x[x_off + h*arg.W+w] * f[f_off + r*arg.S+s];
-            }
-          }
-        }
-      });
-    });
+  #else // USM
+
+  sycl::queue &device_queue = get_queue(engine_kind);
+
+  #ifdef DEBUG
+  std::cout << device_queue.get_device().get_info<sycl::info::device::name>();
+  #endif
+
+  // Micro-batches of nb images, each one in one of the sets of buffers
+  int nb = micro_batch ? std::min(micro_batch, N) : N;
+  int depth = nb < N ? pipeline_depth : 1;
+  size_t x_size = (size_t)nb*C*H*W, y_size = (size_t)nb*K*P*Q;
+  size_t residual_size = epilogue.has_residual ? y_size : 0;
+
+  float *x = x_dev.get(device_queue, depth*x_size);
+  float *f = f_dev.get(device_queue, (size_t)K*C*R*S);
+  float *y = y_dev.get(device_queue, depth*y_size);
+  float *bias = bias_dev.get(device_queue, bias_vec.size());
+  float *residual = residual_dev.get(device_queue, depth*residual_size);
+  constants_t *args = args_dev.get(device_queue, depth);
+  x_stage.init(device_queue, depth, x_size);
+  y_stage.init(device_queue, depth, y_size);
+  residual_stage.init(device_queue, depth, residual_size);
+  // One host copy of the constants per micro-batch, as they are copied
+  // asynchronously
+  std::vector<constants_t> batch_constants((N+nb-1)/nb, constants);
+  // Host tensors, in the mapping of their files if used in place
+  float *x_host = host_data(input_file, x_vec);
+  float *f_host = host_data(filters_file, f_vec);
+  float *y_host = host_data(output_file, y_vec);
+
+  // Copy the filters to the device, once for all the micro-batches
+  transfer_time = 0;
+  transfer_begin();
+  profile("copy", "f", 
+          copy_to_device(device_queue, f, f_host, (size_t)K*C*R*S)).wait();
+  profile("copy", "bias", copy_to_device(device_queue, bias, bias_vec)).wait();
+  transfer_end();
+
+  stream_batches(device_queue, N, nb, depth,
+
+    // Copy the images of the micro-batch and their residual to the slot
+    [&](int n0, int size, int slot, std::vector<sycl::event> deps) {
+      constants_t &batch = batch_constants[n0/nb];
+      batch.N = size;
+      // Read ahead this micro-batch and the next one, and drop the ones 
+      // already copied: only the depth-1 before it can be in flight
+      stream_file(input_file, x_host, (size_t)n0*C*H*W, 2*x_size, 
+                  (depth-1)*x_size);
+      std::vector<sycl::event> copies = {
+        profile("copy", "x", 
+          device_queue.memcpy(&x[slot*x_size], 
+            x_stage.in(&x_host[(size_t)n0*C*H*W], (size_t)size*C*H*W, slot),
+            (size_t)size*C*H*W*sizeof(float), deps)),
+        profile("copy", "args", 
+          device_queue.memcpy(&args[slot], &batch, sizeof(constants_t), deps))
+      };
+      if (residual_size) {
+        copies.push_back(profile("copy", "residual", 
+          device_queue.memcpy(&residual[slot*residual_size], 
+            residual_stage.in(&residual_vec[(size_t)n0*K*P*Q], 
+                              (size_t)size*K*P*Q, slot),
+            (size_t)size*K*P*Q*sizeof(float), deps)));
+      }
+      return copies;
+    },
+
+    // Submit command group to queue to perform convolution: y = x * f
+    [&](int n0, int size, int slot, std::vector<sycl::event> deps) {
+      return profile("kernel", "convolution", 
+        device_queue.submit([&](sycl::handler &context) {
+          context.depends_on(deps);
+          submit_convolution(context, size, &x[slot*x_size], f, 
+                             &y[slot*y_size], bias, 
+                             &residual[slot*residual_size], &args[slot]);
+        }));
+    },
+
+    // Copy the outputs back to the host
+    [&](int n0, int size, int slot, std::vector<sycl::event> deps) {
+      return profile("copy", "y", 
+        device_queue.memcpy(y_stage.out(&y_host[(size_t)n0*K*P*Q], slot),
+                            &y[slot*y_size], (size_t)size*K*P*Q*sizeof(float),
+                            deps));
+    },
+
+    // Move the outputs out of their pinned slot, if staged, let the ones
+    // written to the file reach it, and read ahead the next
+    [&](int n0, int size, int slot) {
+      y_stage.drain(&y_host[(size_t)n0*K*P*Q], (size_t)size*K*P*Q, slot);
+      stream_file(output_file, y_host, (size_t)(n0+size)*K*P*Q, y_size, 0);
+    }
+  );
+
+  write_profile(device_queue, "direct_parallel_usm");
+
+  #endif
 
-  } // y_vec is updated when y_buf is destroyed upon exiting scope
+  save_output(host_data(output_file, y_vec), (size_t)N*K*P*Q);
 
   #ifdef DEBUG // only run the sequential convolution if debugging
-  compare(cpu_convolution(), y_vec);
+  compare(cpu_convolution(), host_data(output_file, y_vec));
   #endif
 }
 
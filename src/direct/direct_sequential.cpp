@@ -1,4 +1,3 @@
-
 /**
  * direct_sequential.cpp
  * 
@@ -7,8 +6,38 @@
 
 #include "../utils.hpp"
 
+/**
+ * Perform convolution on host.
+ */
+void convolution() {
+
+  // The tensors of the files in nchw are used in place and get no vectors,
+  // the others take theirs from the arena
+  arena_vector_t<float> x_vec(
+    in_place(input_file, N, C, H, W) ? 0 : N*C*H*W);
+  arena_vector_t<float> f_vec(
+    in_place(filters_file, K, C, R, S) ? 0 : K*C*R*S);
+  arena_vector_t<float> y_vec(
+    in_place(output_file, N, K, P, Q) ? 0 : N*K*P*Q);
+  std::vector<float> bias_vec, residual_vec;
+
+  init_data(x_vec, f_vec, y_vec);
+  init_epilogue(bias_vec, residual_vec);
+
+  float *x = host_data(input_file, x_vec);
+  float *f = host_data(filters_file, f_vec);
+  float *y = host_data(output_file, y_vec);
+  if (y_vec.empty()) std::fill(y, y + (size_t)N*K*P*Q, 0.f);
+
+  compute_begin();
+  cpu_convolution(x, f, y, bias_vec.data(), residual_vec.data());
+  compute_end();
+
+  save_output(y, (size_t)N*K*P*Q);
+}
+
 int main(int argc, char **argv) {
-  return handle_errors(parse_arguments(argc,argv), cpu_convolution);
+  return handle_errors(parse_arguments(argc,argv), convolution);
 }
 
 //    Copyright 2021 Sara Aguado Couselo
@@ -0,0 +1,229 @@
+/**
+ * fft_sequential.cpp
+ *
+ * Implements the FFT-based convolution algorithm in forward propagation mode.
+ * The images are split in blocks that are transformed with zero padding to
+ * T×T, multiplied by the transformed filters and accumulated over the input
+ * channels in the frequency domain, and transformed back. The outputs of 
+ * neighbouring blocks overlap by R-1 rows and S-1 columns and are added up
+ * (overlap-add).
+ */
+
+#include <complex>
+#include "../utils.hpp"
+
+typedef std::complex<float> complex_t;
+
+int T;                           // size of the transforms, a power of two
+std::vector<complex_t> twiddles; // e^(-2πi·j/T), for j < T/2
+std::vector<int> bit_reversed;   // bit reversal permutation of [0,T)
+
+/**
+ * Complex multiplication without the NaN/Inf checks of std::complex.
+ */
+inline complex_t mul(complex_t a, complex_t b) {
+  return { a.real()*b.real() - a.imag()*b.imag(),
+           a.real()*b.imag() + a.imag()*b.real() };
+}
+
+/**
+ * Chooses the transform size for the filter size and precomputes the 
+ * twiddle factors and the bit reversal permutation.
+ */
+void fft_init() {
+
+  // Blocks of T-R+1 rows: the larger the filter, the larger the transform
+  for (T = 16; T < 4 * std::max(R,S); T *= 2);
+
+  twiddles.resize(T/2);
+  for (int j = 0; j < T/2; j++) {
+    twiddles[j] = std::polar(1.f, (float)(-2 * M_PI * j / T));
+  }
+
+  bit_reversed.resize(T);
+  for (int i = 0, bits = __builtin_ctz(T); i < T; i++) {
+    int r = 0;
+    for (int b = 0; b < bits; b++) r |= ((i >> b) & 1) << (bits-1-b);
+    bit_reversed[i] = r;
+  }
+}
+
+/**
+ * In-place iterative radix-2 FFT of T elements separated by stride.
+ * The inverse transform is not scaled.
+ */
+void fft(complex_t *a, int stride, bool inverse) {
+
+  for (int i = 0; i < T; i++) {
+    int j = bit_reversed[i];
+    if (i < j) std::swap(a[i*stride], a[j*stride]);
+  }
+
+  for (int len = 2; len <= T; len *= 2) {
+    int step = T / len;
+    for (int i = 0; i < T; i += len) {
+      for (int j = 0; j < len/2; j++) {
+        complex_t w = twiddles[j*step];
+        if (inverse) w = std::conj(w);
+        complex_t u = a[(i+j)*stride];
+        complex_t v = mul(a[(i+j+len/2)*stride], w);
+        a[(i+j)*stride] = u + v;
+        a[(i+j+len/2)*stride] = u - v;
+      }
+    }
+  }
+}
+
+/**
+ * 2D FFT of a T×T tile: the rows, then the columns. Only the first rows
+ * are transformed, the others are known to be zero.
+ */
+void fft2d(complex_t *a, int rows, bool inverse) {
+
+  for (int i = 0; i < rows; i++) fft(&a[i*T], 1, inverse);
+  for (int j = 0; j < T; j++) fft(&a[j], T, inverse);
+}
+
+/**
+ * Transforms the filters, flipped so that the convolution in the frequency
+ * domain computes a correlation, into K×C tiles of T×T.
+ */
+void filter_transform(complex_t *F, float *f) {
+
+  for (int k = 0; k < K; k++) {
+    for (int c = 0; c < C; c++) {
+      complex_t *tile = &F[(k*C + c)*T*T];
+      std::fill(tile, tile + T*T, 0);
+
+      for (int r = 0; r < R; r++)
+        for (int s = 0; s < S; s++)
+          tile[r*T + s] = f[k*C*R*S + c*R*S + (R-1-r)*S + (S-1-s)];
+
+      fft2d(tile, R, false);
+    }
+  }
+}
+
+/**
+ * Convolves an image block by block: for every block of (T-R+1)×(T-S+1)
+ * inputs, transforms it in all the channels, accumulates its products with
+ * the filters over C and adds the transformed back result to y. The rows
+ * of y get the epilogue as soon as no more blocks contribute to them; y_off
+ * is the position of y in the output tensor.
+ */
+void fft_convolution(float *y, float *x, complex_t *F, complex_t *X, 
+                     complex_t *Y, float *bias, float *residual, 
+                     size_t y_off) {
+
+  int LH = T-R+1, LW = T-S+1; // block size
+  int done = 0; // rows of y with the epilogue applied
+
+  for (int h0 = 0; h0 < H; h0 += LH) {
+    for (int w0 = 0; w0 < W; w0 += LW) {
+      int rows = std::min(LH, H-h0);
+      int cols = std::min(LW, W-w0);
+
+      // Transform the block in every input channel
+      for (int c = 0; c < C; c++) {
+        complex_t *tile = &X[c*T*T];
+        std::fill(tile, tile + T*T, 0);
+
+        for (int i = 0; i < rows; i++)
+          for (int j = 0; j < cols; j++)
+            tile[i*T + j] = x[c*H*W + (h0+i)*W + (w0+j)];
+
+        fft2d(tile, rows, false);
+      }
+
+      for (int k = 0; k < K; k++) {
+
+        // Accumulate the products over the input channels
+        std::fill(Y, Y + T*T, 0);
+        for (int c = 0; c < C; c++) {
+          complex_t *Xc = &X[c*T*T], *Fkc = &F[(k*C + c)*T*T];
+          for (int i = 0; i < T*T; i++) {
+            Y[i] += mul(Xc[i], Fkc[i]);
+          }
+        }
+
+        fft2d(Y, T, true);
+
+        // Overlap-add: the block contributes to R-1 rows and S-1 columns
+        // of outputs before it, which other blocks also contribute to
+        for (int i = 0; i < rows+R-1; i++) {
+          int p = h0 + i - (R-1);
+          if (p < 0 || p >= P) continue;
+
+          for (int j = 0; j < cols+S-1; j++) {
+            int q = w0 + j - (S-1);
+            if (q < 0 || q >= Q) continue;
+
+            y[k*P*Q + p*Q + q] += Y[i*T + j].real() / (T*T);
+          }
+        }
+      }
+    }
+
+    // The next row of blocks only contributes to rows from h0+LH-(R-1)
+    int ready = h0+LH < H ? std::min(P, h0+LH-(R-1)) : P;
+    if (epilogue.enabled()) {
+      for (int k = 0; k < K; k++) {
+        for (int i = k*P*Q + done*Q; i < k*P*Q + ready*Q; i++) {
+          y[i] = epilogue.apply(y[i], bias, residual, k, y_off + i);
+        }
+      }
+    }
+    done = ready;
+  }
+}
+
+/**
+ * Filter transform once, then blocked FFT convolution of every image.
+ */
+void convolution() {
+
+  arena_vector_t<float> x_vec(N*C*H*W);
+  arena_vector_t<float> f_vec(K*C*R*S);
+  arena_vector_t<float> y_vec(N*K*P*Q);
+  std::vector<float> bias_vec, residual_vec;
+
+  init_data(x_vec, f_vec, y_vec);
+  init_epilogue(bias_vec, residual_vec);
+  fft_init();
+
+  arena_buffer_t<complex_t> F((size_t)K*C*T*T); // transformed filters
+  arena_buffer_t<complex_t> X((size_t)C*T*T);   // transformed input block
+  arena_buffer_t<complex_t> Y((size_t)T*T);     // transformed output block
+
+  compute_begin();
+  filter_transform(F, f_vec.data());
+  for (int n = 0; n < N; n++) {
+    fft_convolution(&y_vec[n*K*P*Q], &x_vec[n*C*H*W], F, X, Y,
+                    bias_vec.data(), residual_vec.data(), (size_t)n*K*P*Q);
+  }
+  compute_end();
+
+  save_output(y_vec);
+
+  #ifdef DEBUG // only run the sequential convolution if debugging
+  compare(cpu_convolution(), y_vec, 1e-3); // transforms change the rounding
+  #endif
+}
+
+int main(int argc, char **argv) {
+  return handle_errors(parse_arguments(argc,argv), convolution);
+}
+
+//    Copyright 2021 Sara Aguado Couselo
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
@@ -3,6 +3,10 @@
  * gemm_parallel.cpp
  * 
  * Implements the gemm-based convolution algorithm in forward propagation mode.
+ *
+ * The im2col workspace is bounded by --workspace=MB: the batch is processed
+ * in tiles of images and, if a single image does not fit, of output rows,
+ * whose im2col fits in the budget.
  */
 
 #include "../utils.hpp"
@@ -16,99 +20,361 @@ struct constants_t {
   int hw,rs,pq,chw,crs,kpq; // precomputed variables
 };
 
+/**
+ * Tile of the batch whose im2col is in the workspace: nb images from n0 and
+ * ph output rows from p0.
+ */
+struct tile_t {
+  int n0, nb, p0, ph;
+};
+
+/**
+ * Chooses the images and output rows per tile so that the im2col of slots
+ * tiles fits in the workspace budget: whole images if at least one fits, 
+ * rows otherwise. Fails if not even one row fits.
+ */
+void tile_size(int batch, int slots, int &nb, int &ph) {
+
+  size_t row_bytes = (size_t)C*R*S*Q*sizeof(float);
+  size_t image_bytes = row_bytes*P;
+  size_t budget = workspace_budget ? workspace_budget / slots : SIZE_MAX;
+
+  if (budget < row_bytes) {
+    size_t needed = (slots*row_bytes + ((size_t)1 << 20)-1) >> 20;
+    throw std::runtime_error("the im2col of an output row needs a "
+                             "workspace of " + std::to_string(needed) + " MB");
+  }
+
+  nb = std::max<size_t>(1, std::min<size_t>(batch, budget / image_bytes));
+  ph = budget >= image_bytes ? P : budget / row_bytes;
+}
+
+/**
+ * Submits the im2col kernel of a tile to the command group: 
+ * b = im2col(x[n0:n0+nb][:][p0:p0+ph+R-1][:]). The tensors are accessors in 
+ * the buffer mode and device pointers in the USM mode.
+ */
+template <class X, class B, class Args>
+void submit_im2col(sycl::handler &context, tile_t tile, X x, B b, Args args) {
+
+  context.parallel_for(sycl::range(tile.nb,C,R*S), [=](auto index) {
+    
+    auto arg = args[0];
+    int n = index[0];
+    int c = index[1];
+    int r = index[2] / arg.S;
+    int s = index[2] % arg.S;
+    size_t tpq = (size_t)tile.ph*arg.Q;
+
+    size_t x_off = (size_t)(tile.n0 + n)*arg.chw + (size_t)c*arg.hw;
+    size_t b_off = (size_t)n*arg.crs*tpq + (size_t)c*arg.rs*tpq;
+
+    for (int p = 0; p < tile.ph && tile.p0+p < arg.P; p++) {
+      for (int q = 0; q < arg.Q; q++) {
+
+        int h = tile.p0 + p + r, row = r*arg.S + s;
+        int w = q + s, col = p*arg.Q + q;
+
+        b[b_off + row*tpq + col] = x[x_off + (size_t)h*arg.W + w];
+      }
+    }
+  });
+}
+
+/**
+ * Submits the matmul kernel of a tile to the command group: y = f · b, 
+ * followed by the epilogue.
+ */
+template <class F, class Y, class B, class Bias, class Residual, class Args>
+void submit_matmul(sycl::handler &context, tile_t tile, F f, Y y, B b, 
+                   Bias bias, Residual residual, Args args) {
+
+  epilogue_t epi = epilogue; // globals are not accessible from the kernel
+  int cols = std::min(tile.ph, P - tile.p0) * Q;
+
+  context.parallel_for(sycl::range(tile.nb,K,cols), [=](auto index) {
+    
+    auto arg = args[0];
+    int n = index[0];
+    int i = index[1];
+    int j = index[2];
+    size_t tpq = (size_t)tile.ph*arg.Q;
+
+    size_t f_off = (size_t)i*arg.crs;
+    size_t b_off = (size_t)n*arg.crs*tpq;
+    size_t y_off = (size_t)(tile.n0 + n)*arg.kpq + (size_t)i*arg.pq 
+                 + (size_t)tile.p0*arg.Q + j;
+    
+    float acc = 0;
+    for (int k = 0; k < arg.crs; k++) {
+      acc += f[f_off + k] * b[b_off + k*tpq + j];
+    }
+
+    y[y_off] = epi.apply(acc, bias, residual, i, y_off);
+  });
+}
+
+/**
+ * Submits the im2col and the matmul of every tile of nb images and ph rows 
+ * of a batch, one after the other as they share the workspace b, after the
+ * events deps. Returns the event of the last matmul.
+ */
+template <class X, class F, class Y, class B, class Bias, class Residual,
+          class Args>
+sycl::event submit_tiles(sycl::queue &device_queue, int batch, int nb, int ph,
+                         std::vector<sycl::event> deps, X x, F f, Y y, B b,
+                         Bias bias, Residual residual, Args args) {
+  for (int n0 = 0; n0 < batch; n0 += nb) {
+    for (int p0 = 0; p0 < P; p0 += ph) {
+      tile_t tile = { n0, std::min(nb, batch - n0), p0, ph };
+
+      sycl::event im2col = profile("kernel", "im2col", 
+        device_queue.submit([&](sycl::handler &context) {
+          context.depends_on(deps);
+          submit_im2col(context, tile, x, b, args);
+        }));
+      deps = { profile("kernel", "matmul", 
+        device_queue.submit([&](sycl::handler &context) {
+          context.depends_on(im2col);
+          submit_matmul(context, tile, f, y, b, bias, residual, args);
+        })) };
+    }
+  }
+  return deps[0];
+}
+
+#ifdef USM
+
+// Device memory, reused across calls. The im2col workspace never leaves the
+// device.
+usm_array_t<float> x_dev, f_dev, y_dev, b_dev, bias_dev, residual_dev;
+usm_array_t<constants_t> args_dev;
+// Pinned host slots of the micro-batches, reused across calls
+staging_t x_stage, y_stage, residual_stage;
+
+#endif
+
 /**
  * im2col transformation + matrix multiplication
+ *
+ * Compiled with -DUSM (gemm_parallel_usm target), the tensors live in 
+ * device memory allocated once with malloc_device, on a queue also created
+ * once, and are moved with explicit memcpy, timed in transfer_time. With
+ * --micro-batch, the batch is streamed through them with stream_batches().
  */
 void convolution(dnnl::engine::kind engine_kind) {
 
   constants_t constants = { N,C,K,H,W,R,S,P,Q,H*W,R*S,P*Q,C*H*W,C*R*S,K*P*Q };
 
-  std::vector<float> x_vec(N*C*H*W);
-  std::vector<float> f_vec(K*C*R*S);
-  std::vector<float> y_vec(N*K*P*Q);
-  float* works = new float[N*C*R*S*P*Q];
+  // The USM engines use the tensors of the files in place, if they can, and
+  // give them no vectors
+  #ifdef USM
+  bool mapped = true;
+  #else
+  bool mapped = false;
+  #endif
+  std::vector<float> x_vec(mapped && in_place(input_file, N, C, H, W) 
+                           ? 0 : (size_t)N*C*H*W);
+  std::vector<float> f_vec(mapped && in_place(filters_file, K, C, R, S) 
+                           ? 0 : (size_t)K*C*R*S);
+  std::vector<float> y_vec(mapped && in_place(output_file, N, K, P, Q) 
+                           ? 0 : (size_t)N*K*P*Q);
+  std::vector<float> bias_vec, residual_vec;
 
   init_data(x_vec, f_vec, y_vec);
+  init_epilogue(bias_vec, residual_vec);
+  numa_spread(engine_kind, x_vec, y_vec);
+
+  #ifndef USM
+
+  // Workspace of one tile, only in the device
+  int nb, ph;
+  tile_size(N, 1, nb, ph);
+  size_t b_size = (size_t)nb*C*R*S*ph*Q;
+  workspace_bytes = b_size * sizeof(float);
 
   {
 
     // Initialize the device queue with the custom selector. The device queue is
     // used to enqueue kernels. It encapsulates all states needed for execution.
     sycl::queue device_queue(
-      select_device(engine_kind), dpc_common::exception_handler
+      select_device(engine_kind), dpc_common::exception_handler, 
+      queue_properties()
     );
     
     #ifdef DEBUG
     std::cout << device_queue.get_device().get_info<sycl::info::device::name>();
     #endif
 
-    // Create buffers for tensors, buffer c is bound with host memory y_vec
-    // Allocate DPC++ buffers for input and output memory objects
-    sycl::buffer x_buf(x_vec.data(), sycl::range(N*C*H*W));
-    sycl::buffer f_buf(f_vec.data(), sycl::range(K*C*R*S));
-    sycl::buffer y_buf(y_vec.data(), sycl::range(N*K*P*Q));
-    sycl::buffer b_buf(works, sycl::range(N*C*R*S*P*Q));
-    sycl::buffer args_buf(&constants, sycl::range(1));
-
-    // Submit command group to queue to perform im2col
-    device_queue.submit([&](sycl::handler &context) {
-
-      sycl::accessor x(x_buf, context, sycl::read_only);
-      sycl::accessor b(b_buf, context, sycl::write_only);
-      sycl::accessor args(args_buf, context, sycl::read_only);
-
-      context.parallel_for(sycl::range(N,C,R*S), [=](auto index) {
-        
-        auto arg = args[0];
-        int n = index[0];
-        int c = index[1];
-        int r = index[2] / arg.S;
-        int s = index[2] % arg.S;
-
-        int x_off = n*arg.chw        + c*arg.hw;
-        int b_off = n*arg.crs*arg.pq + c*arg.rs*arg.pq;
-
-        for (int p = 0; p < arg.P; p++) {
-          for (int q = 0; q < arg.Q; q++) {
-
-            int h = p + r, row = r*arg.S + s;
-            int w = q + s, col = p*arg.Q + q;
-
-            b[b_off + row*arg.pq + col] = x[x_off + h*arg.W + w];
-          }
-        }
-      });
-    }).wait_and_throw();
-
-    // Submit command group to queue to perform matmul
-    device_queue.submit([&](sycl::handler &context) {
-
-      sycl::accessor f(f_buf, context, sycl::read_only);
-      sycl::accessor y(y_buf, context, sycl::write_only);
-      sycl::accessor b(b_buf, context, sycl::read_only);
-      sycl::accessor args(args_buf, context, sycl::read_only);
-
-      context.parallel_for(sycl::range(N,K,P*Q), [=](auto index) {
-        
-        auto arg = args[0];
-        int n = index[0];
-        int i = index[1];
-        int j = index[2];
-
-        int f_off = i*arg.crs;
-        int b_off = n*arg.crs*arg.pq;
-        int y_off = n*arg.kpq + i*arg.pq + j;
-        
-        for (int k = 0; k < arg.crs; k++) {
-          y[y_off] += f[f_off + k] * b[b_off + k*arg.pq + j];
-        }
-      });
-    });
-
-  } // y_vec is updated when y_buf is destroyed upon exiting scope
+    // Create buffers for tensors. They are not bound to the host memory, but
+    // filled and read back with explicit copies, so that the profile reports
+    // every transfer
+    sycl::buffer<float, 1> x_buf{sycl::range<1>(x_vec.size())};
+    sycl::buffer<float, 1> f_buf{sycl::range<1>(f_vec.size())};
+    sycl::buffer<float, 1> y_buf{sycl::range<1>(y_vec.size())};
+    sycl::buffer<float, 1> b_buf{sycl::range<1>(b_size)};
+    sycl::buffer<float, 1> bias_buf{sycl::range<1>(bias_vec.size())};
+    sycl::buffer<float, 1> residual_buf{sycl::range<1>(residual_vec.size())};
+    sycl::buffer<constants_t, 1> args_buf{sycl::range<1>(1)};
+
+    compute_begin();
+
+    copy_to_buffer(device_queue, "x", x_vec.data(), x_buf);
+    copy_to_buffer(device_queue, "f", f_vec.data(), f_buf);
+    copy_to_buffer(device_queue, "bias", bias_vec.data(), bias_buf);
+    if (epilogue.has_residual) {
+      copy_to_buffer(device_queue, "residual", residual_vec.data(), 
+                     residual_buf);
+    }
+    copy_to_buffer(device_queue, "args", &constants, args_buf);
+
+    for (int n0 = 0; n0 < N; n0 += nb) {
+      for (int p0 = 0; p0 < P; p0 += ph) {
+        tile_t tile = { n0, std::min(nb, N - n0), p0, ph };
+
+        // Submit command group to queue to perform im2col
+        profile("kernel", "im2col", 
+                device_queue.submit([&](sycl::handler &context) {
+
+          sycl::accessor x(x_buf, context, sycl::read_only);
+          sycl::accessor b(b_buf, context, sycl::write_only);
+          sycl::accessor args(args_buf, context, sycl::read_only);
+
+          submit_im2col(context, tile, x, b, args);
+        }));
+
+        // Submit command group to queue to perform matmul
+        profile("kernel", "matmul", 
+                device_queue.submit([&](sycl::handler &context) {
+
+          sycl::accessor f(f_buf, context, sycl::read_only);
+          sycl::accessor y(y_buf, context, sycl::read_write);
+          sycl::accessor b(b_buf, context, sycl::read_only);
+          sycl::accessor bias(bias_buf, context, sycl::read_only);
+          sycl::accessor residual(residual_buf, context, sycl::read_only);
+          sycl::accessor args(args_buf, context, sycl::read_only);
+
+          submit_matmul(context, tile, f, y, b, bias, residual, args);
+        }));
+      }
+    }
+    device_queue.wait_and_throw();
+
+    compute_end();
+
+    // Read the output back, out of the compute region
+    copy_from_buffer(device_queue, "y", y_buf, y_vec.data()).wait();
+
+    write_profile(device_queue, "gemm_parallel");
+
+  }
+
+  #else // USM
+
+  sycl::queue &device_queue = get_queue(engine_kind);
+
+  #ifdef DEBUG
+  std::cout << device_queue.get_device().get_info<sycl::info::device::name>();
+  #endif
+
+  // Micro-batches of nb images, each one in one of the sets of buffers, and
+  // one tile of workspace per set
+  int nb = micro_batch ? std::min(micro_batch, N) : N;
+  int depth = nb < N ? pipeline_depth : 1;
+  int tile_nb, tile_ph;
+  tile_size(nb, depth, tile_nb, tile_ph);
+  size_t x_size = (size_t)nb*C*H*W, y_size = (size_t)nb*K*P*Q;
+  size_t b_size = (size_t)tile_nb*C*R*S*tile_ph*Q;
+  size_t residual_size = epilogue.has_residual ? y_size : 0;
+  workspace_bytes = depth * b_size * sizeof(float);
+
+  float *x = x_dev.get(device_queue, depth*x_size);
+  float *f = f_dev.get(device_queue, (size_t)K*C*R*S);
+  float *y = y_dev.get(device_queue, depth*y_size);
+  float *b = b_dev.get(device_queue, depth*b_size);
+  float *bias = bias_dev.get(device_queue, bias_vec.size());
+  float *residual = residual_dev.get(device_queue, depth*residual_size);
+  constants_t *args = args_dev.get(device_queue, depth);
+  x_stage.init(device_queue, depth, x_size);
+  y_stage.init(device_queue, depth, y_size);
+  residual_stage.init(device_queue, depth, residual_size);
+  // One host copy of the constants per micro-batch, as they are copied
+  // asynchronously
+  std::vector<constants_t> batch_constants((N+nb-1)/nb, constants);
+  // Host tensors, in the mapping of their files if used in place
+  float *x_host = host_data(input_file, x_vec);
+  float *f_host = host_data(filters_file, f_vec);
+  float *y_host = host_data(output_file, y_vec);
+
+  // Copy the filters to the device, once for all the micro-batches
+  transfer_time = 0;
+  transfer_begin();
+  profile("copy", "f", 
+          copy_to_device(device_queue, f, f_host, (size_t)K*C*R*S)).wait();
+  profile("copy", "bias", copy_to_device(device_queue, bias, bias_vec)).wait();
+  transfer_end();
+
+  stream_batches(device_queue, N, nb, depth,
+
+    // Copy the images of the micro-batch and their residual to the slot
+    [&](int n0, int size, int slot, std::vector<sycl::event> deps) {
+      constants_t &batch = batch_constants[n0/nb];
+      batch.N = size;
+      // Read ahead this micro-batch and the next one, and drop the ones 
+      // already copied: only the depth-1 before it can be in flight
+      stream_file(input_file, x_host, (size_t)n0*C*H*W, 2*x_size, 
+                  (depth-1)*x_size);
+      std::vector<sycl::event> copies = {
+        profile("copy", "x", 
+          device_queue.memcpy(&x[slot*x_size], 
+            x_stage.in(&x_host[(size_t)n0*C*H*W], (size_t)size*C*H*W, slot),
+            (size_t)size*C*H*W*sizeof(float), deps)),
+        profile("copy", "args", 
+          device_queue.memcpy(&args[slot], &batch, sizeof(constants_t), deps))
+      };
+      if (residual_size) {
+        copies.push_back(profile("copy", "residual", 
+          device_queue.memcpy(&residual[slot*residual_size], 
+            residual_stage.in(&residual_vec[(size_t)n0*K*P*Q], 
+                              (size_t)size*K*P*Q, slot),
+            (size_t)size*K*P*Q*sizeof(float), deps)));
+      }
+      return copies;
+    },
+
+    // Submit command groups to queue to perform im2col, then matmul, for 
+    // every tile of the micro-batch
+    [&](int n0, int size, int slot, std::vector<sycl::event> deps) {
+      return submit_tiles(device_queue, size, tile_nb, tile_ph, deps, 
+                          &x[slot*x_size], f, &y[slot*y_size], &b[slot*b_size],
+                          bias, &residual[slot*residual_size], &args[slot]);
+    },
+
+    // Copy the outputs back to the host
+    [&](int n0, int size, int slot, std::vector<sycl::event> deps) {
+      return profile("copy", "y", 
+        device_queue.memcpy(y_stage.out(&y_host[(size_t)n0*K*P*Q], slot),
+                            &y[slot*y_size], (size_t)size*K*P*Q*sizeof(float),
+                            deps));
+    },
+
+    // Move the outputs out of their pinned slot, if staged, let the ones
+    // written to the file reach it, and read ahead the next
+    [&](int n0, int size, int slot) {
+      y_stage.drain(&y_host[(size_t)n0*K*P*Q], (size_t)size*K*P*Q, slot);
+      stream_file(output_file, y_host, (size_t)(n0+size)*K*P*Q, y_size, 0);
+    }
+  );
+
+  write_profile(device_queue, "gemm_parallel_usm");
+
+  #endif
+
+  save_output(host_data(output_file, y_vec), (size_t)N*K*P*Q);
 
   #ifdef DEBUG // only run the sequential convolution if debugging
-  compare(cpu_convolution(), y_vec); 
+  std::cout << ": workspace " << workspace_bytes / 1048576.0 << " MB";
+  compare(cpu_convolution(), host_data(output_file, y_vec)); 
   #endif
 }
 
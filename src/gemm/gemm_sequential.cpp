@@ -8,27 +8,24 @@
 #include "../utils.hpp"
 
 /**
- * Transforms a 3D input tensor into a 2D matrix.
+ * Transforms a 3D input tensor into a 2D matrix. With unit stride and no
+ * padding, the Q columns of an output row p of the row (c,r,s) are the 
+ * contiguous run x[c][p+r][s:s+Q], so they are copied with one memcpy.
  */
 void im2col(float *y, float *x) {
 
-  int c, h, w, r, s, p, q, row, col;
-  int hw=H*W, pq=P*Q, rspq=R*S*P*Q;
+  PERF_REGION("im2col");
+  size_t hw=H*W, pq=P*Q;
 
-  for (c = 0; c < C; c++) {
-    int x_off = c * hw;
-    int y_off = c * rspq;
+  for (int c = 0; c < C; c++) {
+    for (int r = 0; r < R; r++) {
+      for (int s = 0; s < S; s++) {
 
-    for (r = 0; r < R; r++) {
-      for (s = 0; s < S; s++) {
-        for (p = 0; p < P; p++) {
-          for (q = 0; q < Q; q++) {
+        float *y_row = &y[((size_t)c*R*S + r*S + s) * pq];
+        float *x_row = &x[c*hw + r*W + s];
 
-            h = p + r; row = r*S + s;
-            w = q + s; col = p*Q + q;
-
-            y[y_off + row*pq+col] = x[x_off + h*W+w];
-          }
+        for (int p = 0; p < P; p++) {
+          std::memcpy(&y_row[p*Q], &x_row[p*W], Q*sizeof(float));
         }
       }
     }
@@ -36,16 +33,27 @@ void im2col(float *y, float *x) {
 }
 
 /**
- * Performs a simple matrix multiplication.
+ * Performs a simple matrix multiplication. Each row of C, an output channel,
+ * gets the epilogue as soon as it is complete; y_off is the position of C
+ * in the output tensor, to index the residual.
  */
-void matmul(float *C, float *A, float *B, int M, int N, int K) {
+void matmul(float *C, float *A, float *B, int M, int N, int K,
+            float *bias, float *residual, size_t y_off) {
 
+  PERF_REGION("matmul", 2.0*M*N*K);
   for (int m = 0; m < M; m++) {
     for (int k = 0; k < K; k++) {
       for (int n = 0; n < N; n++) {
         C[m*N+n] += A[m*K+k] * B[k*N+n];
       }
     }
+
+    if (epilogue.enabled()) {
+      for (int n = 0; n < N; n++) {
+        C[m*N+n] = epilogue.apply(C[m*N+n], bias, residual, m, 
+                                  y_off + m*N+n);
+      }
+    }
   }
 }
 
@@ -54,23 +62,39 @@ void matmul(float *C, float *A, float *B, int M, int N, int K) {
  */
 void convolution() {
 
-  std::vector<float> x_vec(N*C*H*W);
-  std::vector<float> f_vec(K*C*R*S);
-  std::vector<float> y_vec(N*K*P*Q);
+  // The tensors of the files in nchw are used in place and get no vectors,
+  // the others take theirs from the arena
+  arena_vector_t<float> x_vec(
+    in_place(input_file, N, C, H, W) ? 0 : N*C*H*W);
+  arena_vector_t<float> f_vec(
+    in_place(filters_file, K, C, R, S) ? 0 : K*C*R*S);
+  arena_vector_t<float> y_vec(
+    in_place(output_file, N, K, P, Q) ? 0 : N*K*P*Q);
+  std::vector<float> bias_vec, residual_vec;
 
   init_data(x_vec, f_vec, y_vec);
+  init_epilogue(bias_vec, residual_vec);
 
-  float *workspace = new float[C*R*S*P*Q];
+  float *x = host_data(input_file, x_vec);
+  float *f = host_data(filters_file, f_vec);
+  float *y = host_data(output_file, y_vec);
+  if (y_vec.empty()) std::fill(y, y + (size_t)N*K*P*Q, 0.f);
+
+  arena_buffer_t<float> workspace((size_t)C*R*S*P*Q);
+
+  compute_begin();
   for (int n = 0; n < N; n++) {
-    im2col(workspace, &x_vec[n*C*H*W]);
-    matmul(&y_vec[n*K*P*Q], f_vec.data(), workspace, K, P*Q, C*R*S);
+    im2col(workspace, &x[(size_t)n*C*H*W]);
+    matmul(&y[(size_t)n*K*P*Q], f, workspace, K, P*Q, C*R*S,
+           bias_vec.data(), residual_vec.data(), (size_t)n*K*P*Q);
   }
+  compute_end();
+
+  save_output(y, (size_t)N*K*P*Q);
 
   #ifdef DEBUG // only run the sequential convolution if debugging
-  compare(cpu_convolution(), y_vec); 
+  compare(cpu_convolution(), y); 
   #endif
-
-  delete[] workspace;
 }
 
 int main(int argc, char **argv) {
@@ -8,27 +8,24 @@
 #include "../utils.hpp"
 
 /**
- * Transforms a 3D input tensor into a 2D matrix.
+ * Transforms a 3D input tensor into a 2D matrix. With unit stride and no
+ * padding, the Q columns of an output row p of the row (c,r,s) are the 
+ * contiguous run x[c][p+r][s:s+Q], so they are copied with one memcpy.
  */
 void im2col(float *y, float *x) {
 
-  int c, h, w, r, s, p, q, row, col;
-  int hw=H*W, pq=P*Q, rspq=R*S*P*Q;
+  PERF_REGION("im2col");
+  size_t hw=H*W, pq=P*Q;
 
-  for (c = 0; c < C; c++) {
-    int x_off = c * hw;
-    int y_off = c * rspq;
+  for (int c = 0; c < C; c++) {
+    for (int r = 0; r < R; r++) {
+      for (int s = 0; s < S; s++) {
 
-    for (r = 0; r < R; r++) {
-      for (s = 0; s < S; s++) {
-        for (p = 0; p < P; p++) {
-          for (q = 0; q < Q; q++) {
+        float *y_row = &y[((size_t)c*R*S + r*S + s) * pq];
+        float *x_row = &x[c*hw + r*W + s];
 
-            h = p + r; row = r*S + s;
-            w = q + s; col = p*Q + q;
-
-            y[y_off + row*pq+col] = x[x_off + h*W+w];
-          }
+        for (int p = 0; p < P; p++) {
+          std::memcpy(&y_row[p*Q], &x_row[p*W], Q*sizeof(float));
         }
       }
     }
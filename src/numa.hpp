@@ -0,0 +1,155 @@
+/**
+ * numa.hpp
+ *
+ * NUMA placement of the CPU engines, selected with --numa: the nodes of the
+ * machine, read from sysfs, the binding of memory to nodes and the pinning
+ * of threads to their CPUs. Uses the system calls directly, so that it does
+ * not need libnuma.
+ */
+
+#ifndef NUMA_HPP
+#define NUMA_HPP
+
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+// Node of the machine and the CPUs on it
+struct numa_node_t {
+  int id;
+  cpu_set_t cpus;
+};
+
+/**
+ * Returns the nodes with CPUs, from /sys/devices/system/node, or a single
+ * one with the CPUs of the process if there is no NUMA information.
+ */
+inline const std::vector<numa_node_t> &numa_nodes() {
+
+  static std::vector<numa_node_t> nodes = [] {
+    std::vector<numa_node_t> nodes;
+
+    for (int id = 0; id < 1024; id++) {
+      std::ifstream file("/sys/devices/system/node/node" + std::to_string(id)
+                         + "/cpulist");
+      if (!file) continue;
+
+      // Ranges of CPUs such as 0-15,32-47
+      numa_node_t node = { id };
+      CPU_ZERO(&node.cpus);
+      int first, last;
+      char separator;
+      while (file >> first) {
+        last = first;
+        if (file.peek() == '-') file >> separator >> last;
+        for (int cpu = first; cpu <= last; cpu++) CPU_SET(cpu, &node.cpus);
+        if (file.peek() == ',') file >> separator;
+      }
+      if (CPU_COUNT(&node.cpus)) nodes.push_back(node);
+    }
+
+    if (nodes.empty()) {
+      numa_node_t node = { 0 };
+      sched_getaffinity(0, sizeof(node.cpus), &node.cpus);
+      nodes.push_back(node);
+    }
+    return nodes;
+  }();
+
+  return nodes;
+}
+
+// Sets the memory policy of the pages of [data, data+bytes), and moves the
+// ones already touched to follow it. Returns false if the kernel refuses.
+inline bool numa_policy(const void *data, size_t bytes, int mode,
+                        const unsigned long (&mask)[16]) {
+
+  if (!bytes) return true;
+  uintptr_t page = sysconf(_SC_PAGESIZE);
+  uintptr_t begin = (uintptr_t)data / page * page;
+  uintptr_t end = ((uintptr_t)data + bytes + page-1) / page * page;
+
+  return syscall(SYS_mbind, begin, end - begin, mode, mask,
+                 sizeof(mask) * 8, MPOL_MF_MOVE) == 0;
+}
+
+// Binds the pages of [data, data+bytes) to a node.
+inline bool numa_bind(const void *data, size_t bytes, int node) {
+  unsigned long mask[16] = {};
+  int id = numa_nodes()[node].id;
+  mask[id / 64] |= 1ul << (id % 64);
+  return numa_policy(data, bytes, MPOL_BIND, mask);
+}
+
+// Interleaves the pages of [data, data+bytes) across all the nodes.
+inline bool numa_interleave(const void *data, size_t bytes) {
+  unsigned long mask[16] = {};
+  for (auto &node : numa_nodes()) mask[node.id / 64] |= 1ul << (node.id % 64);
+  return numa_policy(data, bytes, MPOL_INTERLEAVE, mask);
+}
+
+// Pins the calling thread, and the threads it creates later, to the CPUs
+// of a node. A thread already pinned to the node is left as it is, so the
+// threads the runtime reuses across parallel regions only make the system
+// call once.
+inline void numa_pin(int node) {
+  thread_local int pinned = -1;
+  if (node == pinned) return;
+  sched_setaffinity(0, sizeof(cpu_set_t), &numa_nodes()[node].cpus);
+  pinned = node;
+}
+
+/**
+ * Spreads the tensors of the engines that cannot choose where their threads
+ * run, such as the SYCL CPU device or oneDNN, across the nodes, so that
+ * every node serves an equal share of their traffic instead of the node
+ * of the main thread, that touched them first in init_data().
+ */
+template <class X, class Y>
+inline void numa_spread(dnnl::engine::kind engine_kind, const X &x,
+                        const Y &y) {
+  if (!numa_mode || engine_kind != dnnl::engine::kind::cpu) return;
+  numa_interleave(x.data(), x.size() * sizeof(x[0]));
+  numa_interleave(y.data(), y.size() * sizeof(y[0]));
+}
+
+/**
+ * Prints how many pages of [data, data+bytes) are on every node, as
+ * name: node pages..., to check the placement of a tensor.
+ */
+inline void numa_report(const char *name, const void *data, size_t bytes) {
+
+  uintptr_t page = sysconf(_SC_PAGESIZE);
+  uintptr_t begin = (uintptr_t)data / page * page;
+  size_t count = ((uintptr_t)data + bytes - begin + page-1) / page;
+
+  std::vector<void *> pages(count);
+  std::vector<int> status(count, -1);
+  for (size_t i = 0; i < count; i++) pages[i] = (void *)(begin + i*page);
+  syscall(SYS_move_pages, 0, count, pages.data(), nullptr, status.data(), 0);
+
+  std::map<int, size_t> per_node;
+  for (int node : status) per_node[node]++;
+
+  std::cout << " " << name << ":";
+  for (auto &[node, on_node] : per_node) {
+    if (node >= 0) std::cout << " node" << node << " " << on_node;
+    else std::cout << " untouched " << on_node;
+  }
+}
+
+#endif
+
+//    Copyright 2021 Sara Aguado Couselo
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
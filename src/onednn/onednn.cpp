@@ -10,138 +10,326 @@
  */
 
 #include "../utils.hpp"
+#include <map>
+#include <memory>
+#include <tuple>
+#include <unordered_map>
 using namespace dnnl;
 
 using format = dnnl::memory::format_tag;
 using type = dnnl::memory::data_type;
 
+/**
+ * Returns the engine of that kind, shared by all the plans, so that the 
+ * tensors allocated for it can be used with any of them.
+ */
+dnnl::engine &get_engine(dnnl::engine::kind engine_kind) {
+
+  static std::map<dnnl::engine::kind, dnnl::engine> engines;
+
+  auto it = engines.find(engine_kind);
+  if (it == engines.end())
+    it = engines.emplace(engine_kind, dnnl::engine(engine_kind, 0)).first;
+  return it->second;
+}
+
+/**
+ * Returns the largest absolute value of n elements.
+ */
+float max_abs(const float *a, size_t n) {
+  float m = 0;
+  for (size_t i = 0; i < n; i++) m = std::max(m, std::fabs(a[i]));
+  return m;
+}
+
+/**
+ * Convolution plan: the primitive for a shape, an algorithm, a precision, 
+ * an epilogue and an engine, and the weights in the layout and the data type
+ * that the primitive prefers. Creating the primitive and reordering the 
+ * weights is done once, and then the plan runs any number of batches.
+ *
+ * In int8, the source is quantized to u8 with a single scale and the weights
+ * to s8 with a scale per output channel, both symmetric: the source must be
+ * non-negative, as after a ReLU. The scale of the source is calibrated with
+ * the first batch. The output scales of the primitive undo both, so the
+ * destination and the epilogue stay in f32.
+ */
+struct plan_t {
+
+  dnnl::engine engine;
+  dnnl::stream stream;
+  convolution_forward::primitive_desc conv_pd;
+  convolution_forward conv_prim;
+
+  // Weights and bias, owned by the plan, in the layouts of the primitive.
+  memory conv_f_mem, b_mem;
+
+  // Work memory for the src and dst, only when the primitive prefers other 
+  // layouts or data types than NCHW f32.
+  memory conv_x_mem, conv_y_mem;
+
+  // Quantization scale of the source (int8 only).
+  float x_scale = 1;
+
+  plan_t(dnnl::engine &engine, algorithm convolution_algorithm,
+         float *x, float *f, float *b)
+    : engine(engine), stream(engine) {
+
+    // Define memory dims
+    dnnl::memory::dims 
+      x_dims = {N,C,H,W},
+      f_dims = {K,C,R,S},
+      y_dims = {N,K,P,Q},
+      b_dims = {K};
+
+    // Data types of the source and the weights for the precision. The
+    // destination and the bias are always f32.
+    type x_type = type::f32, f_type = type::f32;
+    if (precision == precision_t::bf16) x_type = f_type = type::bf16;
+    if (precision == precision_t::int8) x_type = type::u8, f_type = type::s8;
+
+    // Create memory descriptors with format_tag::any for the primitive. This
+    // enables the convolution primitive to choose memory layouts for an
+    // optimized primitive implementation, and these layouts may differ from
+    // the ones provided by the user.
+    memory::desc x_desc(x_dims, x_type, format::any);
+    memory::desc f_desc(f_dims, f_type, format::any);
+    memory::desc y_desc(y_dims, type::f32, format::any);
+    memory::desc b_desc(b_dims, type::f32, format::a);
+
+    // Forces the fallback to the gemm algorithm indicating the format_tag.
+    #ifdef GEMM
+      x_desc = memory::desc(x_dims, x_type, format::nchw);
+      f_desc = memory::desc(f_dims, f_type, format::oihw);
+      y_desc = memory::desc(y_dims, type::f32, format::nchw);
+    #endif
+
+    // Create operation descriptor, with the bias only if the epilogue adds it.
+    convolution_forward::desc conv_desc = epilogue.has_bias
+      ? convolution_forward::desc(
+          prop_kind::forward_inference,     // convolution type
+          convolution_algorithm,            // convolution algorithm
+          x_desc, f_desc, b_desc, y_desc,   // memory descriptors
+          {SH,SW}, {PH_L,PW_L}, {PH_R,PW_R} // stride and padding dimensions
+        )
+      : convolution_forward::desc(
+          prop_kind::forward_inference, convolution_algorithm,
+          x_desc, f_desc, y_desc,
+          {SH,SW}, {PH_L,PW_L}, {PH_R,PW_R}
+        );
+
+    // The rest of the epilogue is applied by the primitive as post-ops: 
+    // y[:] = activation(convolution(x[:],f[:]) + b[:] + residual[:])
+    primitive_attr conv_attr;
+    post_ops conv_ops;
+    const float scale = 1.f;
+
+    if (epilogue.has_residual) {
+      conv_ops.append_binary(algorithm::binary_add, 
+        memory::desc(y_dims, type::f32, format::nchw));
+    }
+    if (epilogue.activation == activation_t::relu) {
+      conv_ops.append_eltwise(scale, algorithm::eltwise_relu, 0.f, 0.f);
+    }
+    if (epilogue.activation == activation_t::clip) {
+      conv_ops.append_eltwise(scale, algorithm::eltwise_clip, 
+                              epilogue.alpha, epilogue.beta);
+    }
+    conv_attr.set_post_ops(conv_ops);
+
+    // Quantization scales: u8 source, s8 weights per output channel. The
+    // bias is added before the output scales, so it is quantized as well.
+    std::vector<float> f_scales(K, 1.f), y_scales(K, 1.f);
+    std::vector<float> b_quantized(b, b + (epilogue.has_bias ? K : 0));
+
+    if (precision == precision_t::int8) {
+      float x_max = max_abs(x, (size_t)N*C*H*W);
+      x_scale = x_max > 0 ? 255 / x_max : 1;
+
+      for (int k = 0; k < K; k++) {
+        float f_max = max_abs(&f[k*C*R*S], C*R*S);
+        f_scales[k] = f_max > 0 ? 127 / f_max : 1;
+        y_scales[k] = 1 / (x_scale * f_scales[k]);
+      }
+      for (int k = 0; k < b_quantized.size(); k++) {
+        b_quantized[k] /= y_scales[k];
+      }
+
+      conv_attr.set_output_scales(1 << 1, y_scales); // mask of dimension K
+    }
+
+    // Create primitive descriptor and primitive.
+    conv_pd = convolution_forward::primitive_desc(conv_desc, conv_attr, engine);
+    conv_prim = convolution_forward(conv_pd);
+
+    // Allocate the work memory of src and dst if the layouts or data types 
+    // of the primitive and the ones provided by the user are different.
+    if (conv_pd.src_desc() != memory::desc(x_dims, type::f32, format::nchw))
+      conv_x_mem = memory(conv_pd.src_desc(), engine);
+    if (conv_pd.dst_desc() != memory::desc(y_dims, type::f32, format::nchw))
+      conv_y_mem = memory(conv_pd.dst_desc(), engine);
+
+    // Copy the weights into the plan, reordering and quantizing them.
+    memory f_mem({f_dims, type::f32, format::oihw}, engine);
+    write_to_dnnl_memory(f, f_mem);
+
+    conv_f_mem = f_mem;
+    if (conv_pd.weights_desc() != f_mem.get_desc()) {
+      primitive_attr f_attr;
+      if (precision == precision_t::int8)
+        f_attr.set_output_scales(1 << 0, f_scales); // mask of dimension K
+
+      conv_f_mem = memory(conv_pd.weights_desc(), engine);
+      reorder(reorder::primitive_desc(f_mem, conv_f_mem, f_attr))
+        .execute(stream, f_mem, conv_f_mem);
+    }
+
+    if (epilogue.has_bias) {
+      b_mem = memory(conv_pd.bias_desc(), engine);
+      write_to_dnnl_memory(b_quantized.data(), b_mem);
+    }
+    stream.wait();
+  }
+
+  /**
+   * Runs the convolution of a batch followed by the epilogue, with x, y and 
+   * the residual in NCHW f32. Only the primitive is timed, not the reorders
+   * and the quantization of x and y.
+   */
+  void execute(memory &x_mem, memory &y_mem, memory &residual_mem) {
+
+    memory src = conv_x_mem ? conv_x_mem : x_mem;
+    memory dst = conv_y_mem ? conv_y_mem : y_mem;
+
+    if (conv_x_mem) {
+      primitive_attr x_attr;
+      if (precision == precision_t::int8)
+        x_attr.set_output_scales(0, {x_scale});
+
+      reorder(reorder::primitive_desc(x_mem, conv_x_mem, x_attr))
+        .execute(stream, x_mem, conv_x_mem);
+    }
+
+    // Wait for the reorders, so that only the convolution is timed.
+    stream.wait();
+    compute_begin();
+
+    std::unordered_map<int, memory> args = {
+      {DNNL_ARG_SRC, src},
+      {DNNL_ARG_WEIGHTS, conv_f_mem},
+      {DNNL_ARG_DST, dst}
+    };
+    if (epilogue.has_bias) {
+      args.insert({DNNL_ARG_BIAS, b_mem});
+    }
+    if (epilogue.has_residual) {
+      args.insert({DNNL_ARG_ATTR_MULTIPLE_POST_OP(0) | DNNL_ARG_SRC_1, 
+                   residual_mem});
+    }
+
+    conv_prim.execute(stream, args);
+
+    stream.wait();
+    compute_end();
+
+    if (conv_y_mem) {
+      reorder(conv_y_mem, y_mem)
+        .execute(stream, conv_y_mem, y_mem);
+    }
+
+    // Wait for the computation to finalize.
+    stream.wait();
+  }
+};
+
+/**
+ * Plans created so far, by shape, algorithm, precision, epilogue and engine.
+ */
+typedef std::tuple<int,int,int,int,int,int,int,algorithm,precision_t,
+                   bool,bool,activation_t,float,float,dnnl::engine::kind> 
+  plan_key_t;
+std::map<plan_key_t, std::unique_ptr<plan_t>> plans;
+
+/**
+ * Returns the plan for the current shape, creating it the first time with
+ * these weights and bias, and with this batch to calibrate the quantization.
+ */
+plan_t &get_plan(dnnl::engine &engine, algorithm convolution_algorithm,
+                 float *x, float *f, float *b) {
+
+  plan_key_t key = { N,C,K,H,W,R,S,convolution_algorithm,precision,
+                     epilogue.has_bias, epilogue.has_residual,
+                     epilogue.activation, epilogue.alpha, epilogue.beta,
+                     engine.get_kind() };
+  auto &plan = plans[key];
+  if (!plan) plan.reset(new plan_t(engine, convolution_algorithm, x, f, b));
+  return *plan;
+}
+
 void convolution(dnnl::engine::kind engine_kind) {
 
   // Define memory dims
   dnnl::memory::dims 
     x_dims = {N,C,H,W},
     f_dims = {K,C,R,S},
-    y_dims = {N,K,P,Q},
-    b_dims = {K};
-
-  // Create execution engine and stream
-  engine engine(engine_kind, 0);
-  stream stream(engine);
-
-  // Create memory descriptors with format_tag::any for the primitive. This
-  // enables the convolution primitive to choose memory layouts for an
-  // optimized primitive implementation, and these layouts may differ from the
-  // ones provided by the user.
-  memory::desc x_desc(x_dims, type::f32, format::any);
-  memory::desc f_desc(f_dims, type::f32, format::any);
-  memory::desc y_desc(y_dims, type::f32, format::any);
-  memory::desc b_desc(b_dims, type::f32, format::a);
-
-  // Forces the fallback to the gemm algorithm indicating the format_tag.
-  #ifdef GEMM
-    x_desc = memory::desc(x_dims, type::f32, format::nchw);
-    f_desc = memory::desc(f_dims, type::f32, format::oihw);
-    y_desc = memory::desc(y_dims, type::f32, format::nchw);
-  #endif
+    y_dims = {N,K,P,Q};
 
-  // Create memory objects = memory descriptors + data. In this example, 
-  // NCHW layout is assumed for src and dst, and OIHW for weights.
-  memory x_mem({x_dims, type::f32, format::nchw}, engine);
-  memory f_mem({f_dims, type::f32, format::oihw}, engine);
-  memory y_mem({y_dims, type::f32, format::nchw}, engine);
-  memory b_mem(b_desc, engine);
-
-  // Allocate buffers.
-  std::vector<float> x_vec(product(x_dims));
-  std::vector<float> f_vec(product(f_dims));
-  std::vector<float> y_vec(product(y_dims), 0);
-  std::vector<float> bias_vec(product(b_dims));
-
-  // Initialize tensors.
-  init_data(x_vec, f_vec, bias_vec);
-
-  // Fill the memory object's handle with the data.
-  write_to_dnnl_memory(x_vec.data(), x_mem);
-  write_to_dnnl_memory(f_vec.data(), f_mem);
-  write_to_dnnl_memory(bias_vec.data(), b_mem);
-
-  // Create operation descriptor.
   #ifdef WINOGRAD
     auto convolution_algorithm = algorithm::convolution_winograd;
   #else
     auto convolution_algorithm = algorithm::convolution_direct;
   #endif
 
-  convolution_forward::desc conv_desc(
-    prop_kind::forward_inference,     // convolution type
-    convolution_algorithm,            // convolution algorithm
-    x_desc, f_desc, b_desc, y_desc,   // memory descriptors
-    {SH,SW}, {PH_L,PW_L}, {PH_R,PW_R} // stride and padding dimensions
-  );
-  
-  // We could indicate additional operations to apply to the result.
-  // For example ReLU: y[:] = ReLU(y[:] + convolution(x[:],f[:]))
-  primitive_attr conv_attr;
-  //post_ops conv_ops;
-  //const float scale = 1.f, alpha = 0.f, beta = 0.f;
-  //conv_ops.append_eltwise(scale, algorithm::eltwise_relu, alpha, beta);
-  //conv_attr.set_post_ops(conv_ops);
-
-  // Create primitive descriptor.
-  convolution_forward::primitive_desc conv_pd(conv_desc, conv_attr, engine);
-
-  // For now, assume that the src, weights, and dst memory layouts generated
-  // by the primitive and the ones provided by the user are identical.
-  auto conv_x_mem = x_mem;
-  auto conv_f_mem = f_mem;
-  auto conv_y_mem = y_mem;
-
-  // Reorder the data in case the src and weights memory layouts generated by
-  // the primitive and the ones provided by the user are different. In this
-  // case, we create additional memory objects with internal buffers that will
-  // contain the reordered data. The data in dst will be reordered after the
-  // convolution computation has finalized.
-  if (conv_pd.src_desc() != x_mem.get_desc()) {
-    conv_x_mem = memory(conv_pd.src_desc(), engine);
-    reorder(x_mem, conv_x_mem)
-      .execute(stream, x_mem, conv_x_mem);
-  }
+  dnnl::engine &engine = get_engine(engine_kind);
 
-  if (conv_pd.weights_desc() != f_mem.get_desc()) {
-    conv_f_mem = memory(conv_pd.weights_desc(), engine);
-    reorder(f_mem, conv_f_mem)
-      .execute(stream, f_mem, conv_f_mem);
-  }
+  // Allocate buffers that the engine can access in place.
+  dnnl_allocator allocator = make_dnnl_allocator(engine);
+  std::vector<float, dnnl_allocator> x_vec(product(x_dims), allocator);
+  std::vector<float, dnnl_allocator> f_vec(product(f_dims), allocator);
+  std::vector<float, dnnl_allocator> y_vec(product(y_dims), 0, allocator);
+  std::vector<float, dnnl_allocator> bias_vec(allocator);
+  std::vector<float, dnnl_allocator> residual_vec(allocator);
 
-  if (conv_pd.dst_desc() != y_mem.get_desc()) {
-    conv_y_mem = memory(conv_pd.dst_desc(), engine);
-  }
+  // Initialize tensors.
+  init_data(x_vec, f_vec, y_vec);
+  init_epilogue(bias_vec, residual_vec);
+  numa_spread(engine_kind, x_vec, y_vec);
 
-  // Create the primitive.
-  convolution_forward conv_prim(conv_pd);
+  // Get the primitive and the weights, prepared by previous calls. The
+  // weights only depend on the shape, so they are the same.
+  plan_t &plan = get_plan(engine, convolution_algorithm, 
+                          x_vec.data(), f_vec.data(), bias_vec.data());
 
-  // Execute the primitive.
-  conv_prim.execute(stream, {
-    {DNNL_ARG_SRC, conv_x_mem},
-    {DNNL_ARG_WEIGHTS, conv_f_mem},
-    {DNNL_ARG_BIAS, b_mem},
-    {DNNL_ARG_DST, conv_y_mem}
-  });
-
-  // Reorder the data in case the dst memory descriptor generated by the
-  // primitive and the one provided by the user are different.
-  if (conv_pd.dst_desc() != y_mem.get_desc()) {
-    reorder(conv_y_mem, y_mem)
-      .execute(stream, conv_y_mem, y_mem);
-  } else {
-    y_mem = conv_y_mem;
+  // Create memory objects = memory descriptors + data. In this example, 
+  // NCHW layout is assumed for src and dst. The memory objects use the 
+  // buffers as their handles, so no data is copied.
+  memory x_mem = make_dnnl_memory({x_dims, type::f32, format::nchw}, 
+                                  engine, x_vec.data());
+  memory y_mem = make_dnnl_memory({y_dims, type::f32, format::nchw}, 
+                                  engine, y_vec.data());
+  memory residual_mem;
+  if (epilogue.has_residual) {
+    residual_mem = make_dnnl_memory({y_dims, type::f32, format::nchw}, 
+                                    engine, residual_vec.data());
   }
 
-  // Wait for the computation to finalize.
-  stream.wait();
+  // Execute the primitive.
+  plan.execute(x_mem, y_mem, residual_mem);
 
-  // Read data from memory object's handle.
+  // Read data from memory object's handle. Nothing to copy if y_mem is bound
+  // to y_vec.
   read_from_dnnl_memory(y_vec.data(), y_mem);
+
+  save_output(y_vec);
+
+  #ifdef DEBUG // only run the sequential convolution if debugging
+  std::vector<float> y_host(y_vec.begin(), y_vec.end());
+  if (precision == precision_t::f32) {
+    compare(cpu_convolution(), y_host, 1e-3); // the primitive may round else
+  } else {
+    error_stats(cpu_convolution(), y_host);
+  }
+  #endif
 }
 
 int main(int argc, char **argv) {
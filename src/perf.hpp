@@ -0,0 +1,311 @@
+/**
+ * perf.hpp
+ *
+ * Hardware counters of the CPU engines, read with perf_event_open around
+ * named regions. Only compiled with -DPERF (make perf), otherwise the
+ * regions are empty.
+ */
+
+#ifndef PERF_HPP
+#define PERF_HPP
+
+#ifdef PERF
+
+#include <array>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Events counted in every region
+enum perf_event_t {
+  PERF_CYCLES, PERF_INSTRUCTIONS, PERF_L1_MISSES, PERF_LLC_MISSES, 
+  PERF_NODE_LOADS, PERF_REMOTE_LOADS, PERF_EVENTS
+};
+
+/**
+ * Counters of the calling thread, opened on its first region. The events
+ * that the CPU or the kernel do not allow stay at zero.
+ */
+struct perf_counters_t {
+  int fd[PERF_EVENTS];
+  static inline bool available = false; // any event of any thread
+
+  perf_counters_t() {
+
+    const std::pair<uint32_t, uint64_t> events[PERF_EVENTS] = {
+      { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+      { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+      { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                            PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                            PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+      { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+      // Loads served by memory, and by the memory of another NUMA node
+      { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_NODE |
+                            PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                            PERF_COUNT_HW_CACHE_RESULT_ACCESS << 16 },
+      { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_NODE |
+                            PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                            PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+    };
+
+    for (int e = 0; e < PERF_EVENTS; e++) {
+      perf_event_attr attr = {};
+      attr.size = sizeof(attr);
+      attr.type = events[e].first;
+      attr.config = events[e].second;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      fd[e] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+      if (fd[e] >= 0) available = true;
+    }
+  }
+
+  ~perf_counters_t() {
+    for (int e = 0; e < PERF_EVENTS; e++) if (fd[e] >= 0) close(fd[e]);
+  }
+
+  void read_all(uint64_t values[PERF_EVENTS]) {
+    for (int e = 0; e < PERF_EVENTS; e++) {
+      values[e] = 0;
+      if (fd[e] >= 0 && read(fd[e], &values[e], sizeof(uint64_t)) < 0) {
+        values[e] = 0;
+      }
+    }
+  }
+};
+
+/**
+ * Totals of a region for a shape: calls, wall time, floating point
+ * operations declared by the region and counted events.
+ */
+struct perf_stats_t {
+  long calls = 0;
+  double time = 0, flops = 0;
+  uint64_t counts[PERF_EVENTS] = {};
+};
+
+typedef std::tuple<std::array<int,7>, std::string> perf_key_t;
+
+std::map<perf_key_t, perf_stats_t> perf_stats;
+std::mutex perf_mutex;
+
+// FMAs on 12 independent accumulators, enough to fill the pipelines of two
+// FMA units, of 16 or 8 floats. Return the FLOPs.
+#if defined(__x86_64__)
+__attribute__((target("avx512f")))
+inline double peak_flops_avx512(long iters) {
+  __m512 acc[12], a = _mm512_set1_ps(0.999f), b = _mm512_set1_ps(1e-3f);
+  for (int i = 0; i < 12; i++) acc[i] = _mm512_set1_ps(i);
+  for (long it = 0; it < iters; it++) {
+    for (int i = 0; i < 12; i++) acc[i] = _mm512_fmadd_ps(acc[i], a, b);
+  }
+  float sum = 0;
+  for (int i = 0; i < 12; i++) sum += _mm512_reduce_add_ps(acc[i]);
+  return sum ? 2.0 * 12 * 16 * iters : 0;
+}
+
+__attribute__((target("avx2,fma")))
+inline double peak_flops_avx2(long iters) {
+  __m256 acc[12], a = _mm256_set1_ps(0.999f), b = _mm256_set1_ps(1e-3f);
+  for (int i = 0; i < 12; i++) acc[i] = _mm256_set1_ps(i);
+  for (long it = 0; it < iters; it++) {
+    for (int i = 0; i < 12; i++) acc[i] = _mm256_fmadd_ps(acc[i], a, b);
+  }
+  float lanes[8], sum = 0;
+  for (int i = 0; i < 12; i++) {
+    _mm256_storeu_ps(lanes, acc[i]);
+    for (float v : lanes) sum += v;
+  }
+  return sum ? 2.0 * 12 * 8 * iters : 0;
+}
+#endif
+
+/**
+ * Measures the FLOP rate of a core, in GFLOPS, with independent FMAs in the
+ * widest vector registers of the CPU.
+ */
+inline double measure_gflops(long iters) {
+
+  double flops = 0;
+  auto start = std::chrono::steady_clock::now();
+
+  #if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx512f")) {
+    flops = peak_flops_avx512(iters);
+  } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    flops = peak_flops_avx2(iters);
+  }
+  #endif
+
+  if (!flops) {
+    float acc[8] = { 0,1,2,3,4,5,6,7 };
+    for (long it = 0; it < iters; it++) {
+      for (int i = 0; i < 8; i++) acc[i] = acc[i] * 0.999f + 1e-3f;
+    }
+    flops = std::accumulate(acc, acc+8, 0.f) ? 2.0 * 8 * iters : 0;
+  }
+
+  return flops / std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count() * 1e-9;
+}
+
+// Returns the best of five measurements of the peak GFLOPS of a core, after
+// a warm up that raises the clock.
+inline double measure_peak_gflops() {
+  double peak = measure_gflops(1 << 24);
+  for (int rep = 0; rep < 5; rep++) {
+    peak = std::max(peak, measure_gflops(1 << 22));
+  }
+  return peak;
+}
+
+/**
+ * Measures the memory bandwidth of a core, in GB/s, copying arrays four
+ * times larger than the last level cache, back and forth.
+ */
+inline double measure_peak_bandwidth(size_t llc_bytes) {
+
+  size_t n = std::max<size_t>(llc_bytes, 16 << 20); // floats, 4× the bytes
+  std::vector<float> a(n, 1), b(n, 0);
+  std::memcpy(b.data(), a.data(), n * sizeof(float)); // fault the pages in
+
+  auto start = std::chrono::steady_clock::now();
+  for (int rep = 0; rep < 4; rep++) {
+    std::memcpy(rep % 2 ? a.data() : b.data(), rep % 2 ? b.data() : a.data(),
+                n * sizeof(float));
+  }
+  double time = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+
+  return 4 * 2.0 * n * sizeof(float) / time * 1e-9; // read + write
+}
+
+/**
+ * Prints the counters of every region and shape at exit, as CSV, with the
+ * GFLOPS, the arithmetic intensity (FLOPs per byte moved from memory,
+ * estimated as LLC misses × line size) and the roofline of the region: the
+ * attainable GFLOPS, min(peak, intensity × bandwidth), whether it bounds
+ * the region by memory or compute, and the fraction of it achieved. The 
+ * roofline is left empty for the regions without FLOPs, and for all of them
+ * if the LLC misses cannot be counted. The loads served by memory are split
+ * into local and remote NUMA nodes, where the CPU counts them.
+ */
+struct perf_report_t {
+
+  ~perf_report_t() {
+
+    if (perf_stats.empty()) return;
+
+    double peak = measure_peak_gflops();
+    double bandwidth = measure_peak_bandwidth(cache_level(3).size);
+    int line = cache_level(1).line;
+
+    std::cout << "# peak " << peak << " GFLOPS, " << bandwidth << " GB/s"
+              << (perf_counters_t::available ? "" : ", no hardware counters")
+              << "\n"
+              << "region,parameters,calls,time,cycles,instructions,ipc,"
+              << "l1_misses,llc_misses,local_loads,remote_loads,bytes,"
+              << "gflops,intensity,attainable,bound,efficiency\n";
+
+    for (auto &[key, stats] : perf_stats) {
+      auto &[shape, name] = key;
+      uint64_t *counts = stats.counts;
+      double bytes = (double)counts[PERF_LLC_MISSES] * line;
+      double gflops = stats.flops / stats.time * 1e-9;
+      double intensity = bytes ? stats.flops / bytes : 0;
+      double attainable = std::min(peak, intensity * bandwidth);
+
+      std::cout << name << ",";
+      for (int d = 0; d < 7; d++) std::cout << (d ? " " : "") << shape[d];
+      std::cout << "," << stats.calls << "," << stats.time
+                << "," << counts[PERF_CYCLES]
+                << "," << counts[PERF_INSTRUCTIONS]
+                << "," << (counts[PERF_CYCLES] ? (double)counts[PERF_INSTRUCTIONS]
+                                                 / counts[PERF_CYCLES] : 0)
+                << "," << counts[PERF_L1_MISSES]
+                << "," << counts[PERF_LLC_MISSES]
+                << "," << counts[PERF_NODE_LOADS] - std::min(
+                            counts[PERF_NODE_LOADS], counts[PERF_REMOTE_LOADS])
+                << "," << counts[PERF_REMOTE_LOADS] << "," << bytes;
+
+      std::cout << "," << gflops;
+      if (stats.flops && bytes) {
+        std::cout << "," << intensity << "," << attainable
+                  << "," << (attainable < peak ? "memory" : "compute")
+                  << "," << gflops / attainable << "\n";
+      } else {
+        std::cout << ",,,,\n";
+      }
+    }
+  }
+} perf_report;
+
+/**
+ * Region of code whose counters and wall time are added to its name and
+ * the current shape while it is in scope. flops are the floating point
+ * operations it performs, if any.
+ */
+class perf_region_t {
+
+  const char *name;
+  double flops;
+  uint64_t start[PERF_EVENTS];
+  std::chrono::steady_clock::time_point start_time;
+
+  static perf_counters_t &counters() {
+    static thread_local perf_counters_t counters;
+    return counters;
+  }
+
+public:
+
+  perf_region_t(const char *name, double flops = 0)
+    : name(name), flops(flops) {
+    counters().read_all(start);
+    start_time = std::chrono::steady_clock::now();
+  }
+
+  ~perf_region_t() {
+    uint64_t end[PERF_EVENTS];
+    counters().read_all(end);
+    double time = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start_time).count();
+
+    std::lock_guard<std::mutex> lock(perf_mutex);
+    perf_stats_t &stats = perf_stats[{ { N,C,K,H,W,R,S }, name }];
+    stats.calls++;
+    stats.time += time;
+    stats.flops += flops;
+    for (int e = 0; e < PERF_EVENTS; e++) stats.counts[e] += end[e] - start[e];
+  }
+};
+
+#define PERF_REGION(...) perf_region_t perf_region(__VA_ARGS__)
+
+#else // PERF
+
+#define PERF_REGION(...)
+
+#endif
+
+#endif
+
+//    Copyright 2021 Sara Aguado Couselo
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
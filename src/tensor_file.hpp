@@ -0,0 +1,185 @@
+/**
+ * tensor_file.hpp
+ *
+ * Binary tensor files: a header with the dimensions, the data type and the
+ * layout of the tensor, followed by its elements from a page boundary, so
+ * that a mapping of the file can be used in place as the tensor.
+ */
+
+#ifndef TENSOR_FILE_HPP
+#define TENSOR_FILE_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Data types of the elements. Only f32 for now.
+enum class dtype_t : uint32_t { f32 };
+
+// First bytes of every tensor file, with the version of the format
+constexpr char TENSOR_MAGIC[8] = { 'C','O','N','V','T','E','N','1' };
+
+/**
+ * Header of a tensor file. dims are the logical dimensions, N C H W for
+ * activations and K C R S for filters, whatever the layout of the elements
+ * (a layout_t; filters are always K×C×R×S). elements counts the padding of
+ * the blocked layouts.
+ */
+struct tensor_header_t {
+  char magic[8];
+  uint32_t dtype, layout;
+  uint64_t dims[4];
+  uint64_t elements;
+  uint64_t offset; // of the elements, in bytes, a multiple of the page size
+};
+
+/**
+ * Tensor file mapped into memory: read-only if opened, writable if created.
+ * advance() lets the kernel read ahead the part of the tensor that is used
+ * next and drop the part already used, so that tensors larger than the
+ * memory stream through it.
+ */
+class tensor_file_t {
+
+  std::string path;
+  int fd = -1;
+  char *map = nullptr;
+  size_t map_bytes = 0;
+  size_t released = 0; // bytes at the start of the mapping already dropped
+
+  static size_t page_size() { return sysconf(_SC_PAGESIZE); }
+
+  void fail(const std::string &what) {
+    std::string message = what + " " + path + ": " + std::strerror(errno);
+    close();
+    throw std::runtime_error(message);
+  }
+
+  void map_file(int protection) {
+    map = (char *)mmap(nullptr, map_bytes, protection, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+      map = nullptr;
+      fail("cannot map");
+    }
+    madvise(map, map_bytes, MADV_SEQUENTIAL);
+  }
+
+public:
+
+  tensor_header_t header = {};
+
+  tensor_file_t() = default;
+  tensor_file_t(const tensor_file_t &) = delete;
+  tensor_file_t &operator=(const tensor_file_t &) = delete;
+  ~tensor_file_t() { close(); }
+
+  explicit operator bool() const { return map != nullptr; }
+
+  float *data() const { return (float *)(map + header.offset); }
+  size_t size() const { return header.elements; }
+
+  // Maps an existing tensor file for reading and checks its header.
+  void open(const std::string &file_path) {
+
+    close();
+    path = file_path;
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) fail("cannot open");
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) fail("cannot stat");
+    if ((size_t)st.st_size < sizeof(tensor_header_t) ||
+        pread(fd, &header, sizeof(header), 0) != sizeof(header)) {
+      errno = EINVAL;
+      fail("no tensor header in");
+    }
+    if (std::memcmp(header.magic, TENSOR_MAGIC, sizeof(TENSOR_MAGIC)) ||
+        header.dtype != (uint32_t)dtype_t::f32 ||
+        header.offset % page_size() ||
+        header.offset + header.elements * sizeof(float) > (size_t)st.st_size) {
+      errno = EINVAL;
+      fail("unsupported or truncated tensor");
+    }
+
+    map_bytes = header.offset + header.elements * sizeof(float);
+    map_file(PROT_READ);
+  }
+
+  // Creates, or truncates, a tensor file for elements f32 with the
+  // dimensions and layout, and maps it for writing.
+  void create(const std::string &file_path, const uint64_t (&dims)[4],
+              uint32_t layout, size_t elements) {
+
+    close();
+    path = file_path;
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) fail("cannot create");
+
+    std::memcpy(header.magic, TENSOR_MAGIC, sizeof(TENSOR_MAGIC));
+    header.dtype = (uint32_t)dtype_t::f32;
+    header.layout = layout;
+    std::memcpy(header.dims, dims, sizeof(header.dims));
+    header.elements = elements;
+    header.offset = (sizeof(header) + page_size()-1) / page_size() * page_size();
+
+    map_bytes = header.offset + elements * sizeof(float);
+    if (ftruncate(fd, map_bytes) < 0) fail("cannot resize");
+    map_file(PROT_READ | PROT_WRITE);
+    std::memcpy(map, &header, sizeof(header));
+  }
+
+  // Unmaps the file; the written pages reach the file in the background.
+  void close() {
+    if (map) munmap(map, map_bytes);
+    if (fd >= 0) ::close(fd);
+    map = nullptr;
+    fd = -1;
+    map_bytes = released = 0;
+  }
+
+  /**
+   * Advises the kernel that the elements [first, first+count) are used next,
+   * so that it reads them ahead, and that the pages before first-behind are
+   * not used any more, so that it can reclaim them. Dropped pages of a
+   * writable file keep their data, and are read again if used again.
+   */
+  void advance(size_t first, size_t count, size_t behind = 0) {
+
+    if (!map) return;
+    size_t page = page_size();
+    size_t begin = (header.offset + first * sizeof(float)) / page * page;
+    size_t end = std::min(header.offset + (first+count) * sizeof(float),
+                          map_bytes);
+    if (begin < end) madvise(map + begin, end - begin, MADV_WILLNEED);
+
+    if (first < behind) return;
+    size_t done = (header.offset + (first-behind) * sizeof(float)) / page * page;
+    if (done > released) {
+      madvise(map + released, done - released, MADV_DONTNEED);
+      released = done;
+    }
+  }
+};
+
+#endif
+
+//    Copyright 2021 Sara Aguado Couselo
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
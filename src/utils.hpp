@@ -8,9 +8,22 @@
 #ifndef UTILS_HPP
 #define UTILS_HPP
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <mutex>
 #include <numeric>
+#include <optional>
+#include <thread>
 #include "dnnl.hpp"
 #include "dnnl_debug.h"
+#include "tensor_file.hpp"
 
 #if DNNL_GPU_RUNTIME == DNNL_RUNTIME_OCL
   #include "dnnl_ocl.hpp"
@@ -18,6 +31,11 @@
   #include "dnnl_sycl.hpp"
 #endif
 
+#if defined(__x86_64__) && !defined(__SYCL_DEVICE_ONLY__)
+  #include <cpuid.h>
+  #include <immintrin.h>
+#endif
+
 #if DNNL_CPU_THREADING_RUNTIME == DNNL_RUNTIME_OMP 
   #ifdef _MSC_VER
     #define PRAGMA_MACRo(x) __pragma(x)
@@ -56,6 +74,260 @@ int
   P = (H - R + PH_L + PH_R) / SH + 1, // output height
   Q = (W - S + PW_L + PW_R) / SW + 1; // output width
 
+// Wall time (in seconds) spent in the compute region of the last convolution.
+// The engines delimit that region with compute_begin() and compute_end(), so
+// it excludes the allocation, initialization and verification of the tensors.
+double compute_time = 0;
+std::chrono::steady_clock::time_point compute_start;
+
+// Marks the beginning of the compute region.
+inline void compute_begin() {
+  compute_start = std::chrono::steady_clock::now();
+}
+
+// Marks the end of the compute region and updates compute_time.
+inline void compute_end() {
+  compute_time = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - compute_start).count();
+}
+
+// Wall time (in seconds) spent in the explicit host-device transfers of the
+// last convolution, out of the compute region. Only the USM engines make 
+// them, the others move the data implicitly.
+double transfer_time = 0;
+std::chrono::steady_clock::time_point transfer_start;
+
+// Marks the beginning of a transfer.
+inline void transfer_begin() {
+  transfer_start = std::chrono::steady_clock::now();
+}
+
+// Marks the end of a transfer and adds it to transfer_time.
+inline void transfer_end() {
+  transfer_time += std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - transfer_start).count();
+}
+
+// Activation function of the epilogue.
+enum class activation_t { none, relu, clip };
+
+// Epilogue fused into the store of the output by every engine:
+// y = activation(x * f + bias[k] + residual[n][k][p][q]). It is selected 
+// from the command line with --bias, --residual, --relu and --clip=LO,HI.
+struct epilogue_t {
+  bool has_bias = false;
+  bool has_residual = false;
+  activation_t activation = activation_t::none;
+  float alpha = 0, beta = 0; // bounds of clip
+
+  bool enabled() const {
+    return has_bias || has_residual || activation != activation_t::none;
+  }
+
+  // Applies the epilogue to the value v of the output channel k, at the
+  // position i of the residual, in the precision of v. Works with pointers 
+  // and SYCL accessors.
+  template <class T, class Bias, class Residual>
+  T apply(T v, const Bias &bias, const Residual &residual,
+              int k, size_t i) const {
+    if (has_bias) v += bias[k];
+    if (has_residual) v += residual[i];
+    if (activation == activation_t::relu) v = v > 0 ? v : 0;
+    if (activation == activation_t::clip) 
+      v = v < alpha ? alpha : v > beta ? beta : v;
+    return v;
+  }
+};
+
+epilogue_t epilogue;
+
+// Data type of the convolution, only for the oneDNN targets: the source and
+// the weights are converted to it, the destination stays in f32.
+enum class precision_t { f32, bf16, int8 };
+
+precision_t precision = precision_t::f32;
+
+// Pipelined mode of the USM engines, selected with --micro-batch=NB and
+// --buffers=2|3: the batch is streamed through the device in micro-batches
+// of micro_batch images, with pipeline_depth sets of device buffers so that
+// the transfers of a micro-batch overlap the compute of the others.
+int micro_batch = 0; // the whole batch at once
+int pipeline_depth = 2;
+
+// Memory budget, in bytes, of the workspaces of the engines that bound them,
+// selected with --workspace=MB (0 is unbounded).
+size_t workspace_budget = (size_t)1024 << 20;
+
+// Bytes of the device workspaces of the last convolution, set by the 
+// engines that bound them and reported by bench.
+size_t workspace_bytes = 0;
+
+// File where the SYCL engines append the profile of their command groups,
+// selected with --profile=FILE (empty is not profiling).
+std::string profile_path;
+
+// Tensor files that replace the synthetic tensors: x, selected with 
+// --input=FILE, and f, with --filters=FILE, set the dimensions; y, with 
+// --output=FILE, receives the result. Opened by parse_arguments().
+std::string input_path, filters_path, output_path;
+tensor_file_t input_file, filters_file, output_file;
+
+/**
+ * Pool of the host workspaces of the CPU engines (packed panels, im2col and
+ * transformed tiles), that keeps the buffers released for the next images 
+ * and calls instead of returning them to the system, so that their pages 
+ * are faulted in once. Buffers are aligned to 64 bytes, a cache line and 
+ * an AVX-512 vector; with --huge-pages, the ones of 2 MB or more are 
+ * aligned to 2 MB and backed by transparent huge pages, which saves TLB 
+ * misses on the large workspaces. Thread safe.
+ */
+class arena_t {
+
+  static constexpr size_t ALIGNMENT = 64, HUGE_PAGE = (size_t)2 << 20;
+
+  struct block_t {
+    void *data;
+    size_t bytes;
+    bool used;
+  };
+
+  std::vector<block_t> blocks;
+  std::mutex mutex;
+  size_t used_bytes = 0, peak_bytes = 0;
+
+public:
+
+  bool huge_pages = false;
+
+  arena_t() = default;
+  arena_t(const arena_t &) = delete;
+  arena_t &operator=(const arena_t &) = delete;
+  ~arena_t() { for (auto &block : blocks) free(block.data); }
+
+  // Returns a buffer of at least bytes: the smallest free one that fits and
+  // wastes less than half of it or, after freeing the free ones, none of
+  // which fits, a new one. So the pool follows the sizes of the requests 
+  // instead of keeping the largest buffers of the previous shapes.
+  void *acquire(size_t bytes) {
+
+    std::lock_guard<std::mutex> lock(mutex);
+    bool huge = huge_pages && bytes >= HUGE_PAGE;
+    size_t alignment = huge ? HUGE_PAGE : ALIGNMENT;
+    bytes = std::max<size_t>((bytes + alignment-1) / alignment * alignment, 
+                             alignment);
+
+    block_t *best = nullptr;
+    for (auto &block : blocks) {
+      if (!block.used && block.bytes >= bytes && block.bytes <= 2*bytes &&
+          (!best || block.bytes < best->bytes) &&
+          (uintptr_t)block.data % alignment == 0) best = &block;
+    }
+
+    if (!best) {
+      blocks.erase(std::remove_if(blocks.begin(), blocks.end(), 
+        [&](block_t &block) { 
+          if (!block.used) free(block.data);
+          return !block.used; 
+        }), blocks.end());
+
+      void *data = aligned_alloc(alignment, bytes);
+      if (!data) throw std::bad_alloc();
+      #ifdef MADV_HUGEPAGE
+      if (huge) madvise(data, bytes, MADV_HUGEPAGE);
+      #endif
+      blocks.push_back({ data, bytes, false });
+      best = &blocks.back();
+    }
+
+    best->used = true;
+    used_bytes += best->bytes;
+    peak_bytes = std::max(peak_bytes, used_bytes);
+    return best->data;
+  }
+
+  // Returns a buffer of acquire() to the pool.
+  void release(void *data) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &block : blocks) {
+      if (block.data == data && block.used) {
+        block.used = false;
+        used_bytes -= block.bytes;
+        return;
+      }
+    }
+  }
+
+  // Largest amount of memory in use at once, in bytes, since the last 
+  // reset_peak().
+  size_t peak() const { return peak_bytes; }
+  void reset_peak() { 
+    std::lock_guard<std::mutex> lock(mutex);
+    peak_bytes = used_bytes; 
+  }
+};
+
+arena_t arena;
+
+// Whether the CPU engines place their tensors, workspaces and threads on 
+// the NUMA nodes, selected with --numa (see numa.hpp).
+bool numa_mode = false;
+
+/**
+ * Buffer of count elements of T from the arena, returned to it when the
+ * buffer goes out of scope. The elements are not initialized.
+ */
+template <class T>
+class arena_buffer_t {
+
+  T *buffer;
+
+public:
+
+  explicit arena_buffer_t(size_t count)
+    : buffer((T *)arena.acquire(count * sizeof(T))) {}
+  arena_buffer_t(const arena_buffer_t &) = delete;
+  arena_buffer_t &operator=(const arena_buffer_t &) = delete;
+  ~arena_buffer_t() { arena.release(buffer); }
+
+  T *data() const { return buffer; }
+  operator T *() const { return buffer; }
+};
+
+/**
+ * Allocator of the standard containers from the arena, so that the tensors
+ * of the CPU engines are aligned and backed by huge pages like their 
+ * workspaces, and keep their pages for the next calls.
+ */
+template <class T>
+struct arena_allocator_t {
+
+  using value_type = T;
+
+  arena_allocator_t() = default;
+  template <class U> arena_allocator_t(const arena_allocator_t<U> &) {}
+
+  T *allocate(size_t count) { return (T *)arena.acquire(count * sizeof(T)); }
+  void deallocate(T *data, size_t) { arena.release(data); }
+
+  template <class U>
+  bool operator==(const arena_allocator_t<U> &) const { return true; }
+  template <class U>
+  bool operator!=(const arena_allocator_t<U> &) const { return false; }
+};
+
+// Vector with its elements in the arena.
+template <class T>
+using arena_vector_t = std::vector<T, arena_allocator_t<T>>;
+
+// Sets the tensor dimensions and recomputes the output size.
+inline void set_dimensions(int n, int c, int k, int h, int w, int r, int s) {
+  N = n; C = c; K = k;
+  H = h; W = w;
+  R = r; S = s;
+  P = (H - R + PH_L + PH_R) / SH + 1; // output height
+  Q = (W - S + PW_L + PW_R) / SW + 1; // output width
+}
+
 // Returns the string representation of the engine kind.
 inline const std::string engine_to_string(dnnl::engine::kind engine_kind) {
   if (engine_kind == dnnl::engine::kind::cpu) return "CPU";
@@ -90,7 +362,10 @@ inline int handle_errors(dnnl::engine::kind engine_kind,
                       << ") = x(" << N << "·" << C << "·" << H << "·" << W
                       << ") * f(" << K << "·" << C << "·" << R << "·" << S
                       << ") on " << engine_to_string(engine_kind) << ": "
-                      << (exit_code ? "failed" : "passed") << std::endl;
+                      << (exit_code ? "failed" : "passed");
+    if (arena.peak()) 
+      std::cout << ", arena peak " << arena.peak() / 1048576.0 << " MB";
+    std::cout << std::endl;
   #endif
 
   return exit_code;
@@ -123,24 +398,81 @@ inline dnnl::engine::kind validate_engine_kind(dnnl::engine::kind engine_kind) {
   return engine_kind;
 }
 
+// Parses the epilogue and precision options and removes them from the 
+// arguments.
+inline void parse_options(int &argc, char **argv) {
+
+  int positional = 1;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+
+    if (arg == "--bias") {
+      epilogue.has_bias = true;
+    } else if (arg == "--residual") {
+      epilogue.has_residual = true;
+    } else if (arg == "--relu") {
+      epilogue.activation = activation_t::relu;
+    } else if (sscanf(argv[i], "--clip=%f,%f", 
+                      &epilogue.alpha, &epilogue.beta) == 2) {
+      epilogue.activation = activation_t::clip;
+    } else if (arg == "--precision=f32") {
+      precision = precision_t::f32;
+    } else if (arg == "--precision=bf16") {
+      precision = precision_t::bf16;
+    } else if (arg == "--precision=int8") {
+      precision = precision_t::int8;
+    } else if (sscanf(argv[i], "--micro-batch=%d", &micro_batch) == 1) {
+      micro_batch = std::max(micro_batch, 0);
+    } else if (sscanf(argv[i], "--buffers=%d", &pipeline_depth) == 1) {
+      pipeline_depth = std::min(std::max(pipeline_depth, 2), 3);
+    } else if (sscanf(argv[i], "--workspace=%zu", &workspace_budget) == 1) {
+      workspace_budget <<= 20;
+    } else if (arg.rfind("--profile=", 0) == 0) {
+      profile_path = arg.substr(10);
+    } else if (arg == "--huge-pages") {
+      arena.huge_pages = true;
+    } else if (arg == "--numa") {
+      numa_mode = true;
+      // Threads of the SYCL CPU device spread across the nodes
+      setenv("DPCPP_CPU_PLACES", "numa_domains", 0);
+      setenv("DPCPP_CPU_CU_AFFINITY", "spread", 0);
+    } else if (arg.rfind("--input=", 0) == 0) {
+      input_path = arg.substr(8);
+    } else if (arg.rfind("--filters=", 0) == 0) {
+      filters_path = arg.substr(10);
+    } else if (arg.rfind("--output=", 0) == 0) {
+      output_path = arg.substr(9);
+    } else {
+      argv[positional++] = argv[i];
+    }
+  }
+
+  argc = positional;
+}
+
+inline void open_tensor_files();
+
 // Parses the program arguments and returns the engine kind.
 inline dnnl::engine::kind parse_arguments(int argc, char **argv) {
 
-  if (argc == 1)
-    return validate_engine_kind(dnnl::engine::kind::cpu);
+  parse_options(argc, argv);
 
   if (argc == 9) {
-    N = atoi(argv[2]);
-    C = atoi(argv[3]);
-    K = atoi(argv[4]);
-    H = atoi(argv[5]);
-    W = atoi(argv[6]);
-    R = atoi(argv[7]);
-    S = atoi(argv[8]);
-    P = (H - R + PH_L + PH_R) / SH + 1; // output height
-    Q = (W - S + PW_L + PW_R) / SW + 1; // output width
+    set_dimensions(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]),
+                   atoi(argv[5]), atoi(argv[6]), atoi(argv[7]), atoi(argv[8]));
+  }
+
+  try {
+    open_tensor_files();
+  } catch (std::exception &e) {
+    std::cout << "Error in the tensor files: " << e.what() << ".\n";
+    exit(1);
   }
 
+  if (argc == 1)
+    return validate_engine_kind(dnnl::engine::kind::cpu);
+
   if (argc == 2 || argc == 9) {
     std::string engine_kind = argv[1];
 
@@ -150,7 +482,12 @@ inline dnnl::engine::kind parse_arguments(int argc, char **argv) {
       return validate_engine_kind(dnnl::engine::kind::gpu);
   }
 
-  std::cout << "Usage: " << argv[0] << " [cpu|gpu] [N C K H W R S]\n";
+  std::cout << "Usage: " << argv[0] << " [cpu|gpu] [N C K H W R S]"
+            << " [--bias] [--residual] [--relu|--clip=LO,HI]"
+            << " [--precision=f32|bf16|int8]"
+            << " [--micro-batch=NB [--buffers=2|3]] [--workspace=MB]"
+            << " [--profile=FILE] [--input=FILE] [--filters=FILE]"
+            << " [--output=FILE] [--huge-pages] [--numa]\n";
   exit(1);
 }
 
@@ -166,6 +503,376 @@ const sycl::device_selector &select_device(dnnl::engine::kind engine_kind) {
   return cpu;
 }
 
+// Returns the properties of the queues of the SYCL engines: with profiling
+// if --profile is given.
+inline sycl::property_list queue_properties() {
+  if (profile_path.empty()) return {};
+  return { sycl::property::queue::enable_profiling() };
+}
+
+// Command groups of the current convolution recorded by profile(): kind 
+// (kernel or copy), name and event.
+struct profiled_event_t {
+  const char *kind, *name;
+  sycl::event event;
+};
+
+std::vector<profiled_event_t> profiled_events;
+
+// Records the event of a command group if profiling, and returns it.
+inline sycl::event profile(const char *kind, const char *name, 
+                           sycl::event event) {
+  if (!profile_path.empty()) profiled_events.push_back({ kind, name, event });
+  return event;
+}
+
+// Appends the recorded command groups of a convolution to the profile file,
+// as one JSON object per line, and forgets them. The timestamps, in ns, are
+// relative to the first submit; queued is the time from submit to start.
+// The summary adds up the time of the command groups of every kind and name.
+void write_profile(sycl::queue &device_queue, const char *executable) {
+
+  if (profile_path.empty()) return;
+
+  using namespace sycl::info;
+  std::ofstream file(profile_path, std::ios::app);
+  std::string device = device_queue.get_device().get_info<device::name>();
+  std::replace(device.begin(), device.end(), '"', '\'');
+
+  uint64_t origin = UINT64_MAX;
+  for (auto &e : profiled_events) {
+    origin = std::min(origin, 
+      e.event.get_profiling_info<event_profiling::command_submit>());
+  }
+
+  std::map<std::pair<std::string, std::string>, std::pair<int, uint64_t>> totals;
+
+  file << "{\"executable\": \"" << executable << "\", \"device\": \"" << device
+       << "\", \"parameters\": [" << N << ", " << C << ", " << K << ", " << H 
+       << ", " << W << ", " << R << ", " << S << "], \"compute_time\": " 
+       << compute_time << ", \"transfer_time\": " << transfer_time 
+       << ", \"events\": [";
+
+  for (size_t i = 0; i < profiled_events.size(); i++) {
+    auto &e = profiled_events[i];
+    uint64_t submit = 
+      e.event.get_profiling_info<event_profiling::command_submit>() - origin;
+    uint64_t start = 
+      e.event.get_profiling_info<event_profiling::command_start>() - origin;
+    uint64_t end = 
+      e.event.get_profiling_info<event_profiling::command_end>() - origin;
+
+    auto &total = totals[{ e.kind, e.name }];
+    total.first++;
+    total.second += end - start;
+
+    file << (i ? ", " : "") << "{\"kind\": \"" << e.kind 
+         << "\", \"name\": \"" << e.name << "\", \"submit\": " << submit 
+         << ", \"start\": " << start << ", \"end\": " << end 
+         << ", \"queued\": " << start - submit 
+         << ", \"duration\": " << end - start << "}";
+  }
+
+  file << "], \"summary\": [";
+  for (auto it = totals.begin(); it != totals.end(); it++) {
+    file << (it == totals.begin() ? "" : ", ") 
+         << "{\"kind\": \"" << it->first.first 
+         << "\", \"name\": \"" << it->first.second 
+         << "\", \"count\": " << it->second.first 
+         << ", \"duration\": " << it->second.second << "}";
+  }
+  file << "]}\n";
+
+  profiled_events.clear();
+}
+
+// Returns the queue of the device type, created on the first call and 
+// reused by the USM engines so that their device memory outlives a call.
+sycl::queue &get_queue(dnnl::engine::kind engine_kind) {
+
+  static std::map<dnnl::engine::kind, sycl::queue> queues;
+
+  auto it = queues.find(engine_kind);
+  if (it == queues.end()) {
+    // Rethrow the asynchronous errors of the kernels in wait_and_throw()
+    auto exception_handler = [](sycl::exception_list exceptions) {
+      for (std::exception_ptr const &e : exceptions) std::rethrow_exception(e);
+    };
+    it = queues.emplace(engine_kind, sycl::queue(
+      select_device(engine_kind), exception_handler, queue_properties())).first;
+  }
+  return it->second;
+}
+
+// Device memory of the USM engines, or USM memory of another kind, reused
+// across calls: it is only reallocated for a larger size or another queue.
+// The context is only set by get(), since the arrays are globals and a 
+// sycl::context constructed at static initialization would select a 
+// platform on its own.
+template <class T, sycl::usm::alloc Kind = sycl::usm::alloc::device>
+struct usm_array_t {
+  T *data = nullptr;
+  size_t size = 0;
+  sycl::queue *queue = nullptr;
+  std::optional<sycl::context> context;
+
+  T *get(sycl::queue &q, size_t n) {
+    if (n > size || &q != queue) {
+      release();
+      data = sycl::malloc<T>(std::max<size_t>(n, 1), q, Kind);
+      if (!data) 
+        throw std::runtime_error("could not allocate " + 
+          std::to_string(n * sizeof(T) / 1048576.0) + " MB of USM memory");
+      size = n;
+      queue = &q;
+      context = q.get_context();
+    }
+    return data;
+  }
+
+  void release() {
+    if (data) sycl::free(data, *context);
+    data = nullptr;
+    size = 0;
+    queue = nullptr;
+  }
+
+  ~usm_array_t() { release(); }
+};
+
+/**
+ * Pinned host slots through which a tensor is streamed by stream_batches()
+ * when the micro-batches are pipelined on a device other than the CPU. The
+ * runtime copies pageable memory through a pinned buffer of its own, which
+ * keeps those copies from overlapping the kernels, so the host moves each 
+ * micro-batch between the tensor and its slot in the stages that own the 
+ * slot, and the device copies from and to the slot. Otherwise the copies 
+ * use the host tensor directly.
+ */
+struct staging_t {
+
+  usm_array_t<float, sycl::usm::alloc::host> memory;
+  size_t slot_size = 0;
+  bool enabled = false;
+
+  // Allocates depth slots of slot_size elements if the copies are staged.
+  void init(sycl::queue &q, int depth, size_t slot_size) {
+    this->slot_size = slot_size;
+    enabled = depth > 1 && slot_size && !q.get_device().is_cpu();
+    if (enabled) memory.get(q, depth * slot_size);
+  }
+
+  // Returns the source of a copy to the device of count elements of host:
+  // the slot, after copying them there, or host itself.
+  const float *in(const float *host, size_t count, int slot) {
+    if (!enabled) return host;
+    std::memcpy(&memory.data[slot*slot_size], host, count * sizeof(float));
+    return &memory.data[slot*slot_size];
+  }
+
+  // Returns the destination of a copy from the device to host: the slot, 
+  // or host itself.
+  float *out(float *host, int slot) {
+    return enabled ? &memory.data[slot*slot_size] : host;
+  }
+
+  // Moves to host the count elements of a copy to out(), once it is done.
+  void drain(float *host, size_t count, int slot) {
+    if (!enabled) return;
+    std::memcpy(host, &memory.data[slot*slot_size], count * sizeof(float));
+  }
+};
+
+// Copies a host vector to device memory, asynchronously.
+template <class T, class Allocator>
+sycl::event copy_to_device(sycl::queue &q, T *dst, 
+                           const std::vector<T, Allocator> &src) {
+  return q.memcpy(dst, src.data(), src.size() * sizeof(T));
+}
+
+// Copies count elements of host memory to device memory, asynchronously.
+template <class T>
+sycl::event copy_to_device(sycl::queue &q, T *dst, const T *src, 
+                           size_t count) {
+  return q.memcpy(dst, src, count * sizeof(T));
+}
+
+// Copies a host array to a buffer with an explicit command, recorded by 
+// profile() as a copy of name, so that the buffer engines report their 
+// transfers like the USM engines.
+template <class T>
+sycl::event copy_to_buffer(sycl::queue &q, const char *name, const T *src,
+                           sycl::buffer<T, 1> &dst) {
+  return profile("copy", name, q.submit([&](sycl::handler &context) {
+    sycl::accessor acc(dst, context, sycl::write_only, sycl::no_init);
+    context.copy(src, acc);
+  }));
+}
+
+// Copies a buffer to a host array with an explicit command, recorded by
+// profile() as a copy of name.
+template <class T>
+sycl::event copy_from_buffer(sycl::queue &q, const char *name, 
+                             sycl::buffer<T, 1> &src, T *dst) {
+  return profile("copy", name, q.submit([&](sycl::handler &context) {
+    sycl::accessor acc(src, context, sycl::read_only);
+    context.copy(acc, dst);
+  }));
+}
+
+// Runs the batch on the device as micro-batches of up to micro_batch images,
+// each one in one of pipeline_depth sets of device buffers: slot i%depth for
+// the micro-batch i. Each stage returns its events and gets the ones it 
+// depends on:
+//   copy_in(n0, nb, slot, deps)  copies the images [n0,n0+nb) to the slot,
+//   compute(n0, nb, slot, deps)  convolves them,
+//   copy_out(n0, nb, slot, deps) copies their outputs back to the host,
+// and retire(n0, nb, slot) runs on the host once the outputs are there. 
+// Before refilling a slot, the host waits until its outputs have been 
+// drained, which means that its compute has read it too, and retires them,
+// so every stage is submitted when the micro-batch depth places before it
+// has completed. With a single micro-batch, the stages run one after the
+// other, and the transfers are timed apart from the compute; otherwise the
+// whole pipeline is the compute region.
+template <class CopyIn, class Compute, class CopyOut, class Retire>
+void stream_batches(sycl::queue &q, int batch, int nb, int depth, 
+                    CopyIn copy_in, Compute compute, CopyOut copy_out,
+                    Retire retire) {
+
+  if (nb >= batch) {
+    transfer_begin();
+    std::vector<sycl::event> in = copy_in(0, batch, 0, {});
+    sycl::event::wait(in);
+    transfer_end();
+
+    compute_begin();
+    compute(0, batch, 0, in).wait_and_throw();
+    compute_end();
+
+    transfer_begin();
+    copy_out(0, batch, 0, {}).wait();
+    retire(0, batch, 0);
+    transfer_end();
+    return;
+  }
+
+  std::vector<sycl::event> drained(depth);
+  int batches = (batch + nb-1) / nb;
+
+  compute_begin();
+  for (int i = 0; i < batches; i++) {
+    int n0 = i*nb, size = std::min(nb, batch - n0);
+    int slot = i % depth;
+
+    // The slot is free once the micro-batch before has been drained; only
+    // the last micro-batch can be smaller
+    if (i >= depth) {
+      drained[slot].wait_and_throw();
+      retire(n0 - depth*nb, nb, slot);
+    }
+
+    std::vector<sycl::event> ready = copy_in(n0, size, slot, {});
+    sycl::event computed = compute(n0, size, slot, ready);
+    drained[slot] = copy_out(n0, size, slot, { computed });
+  }
+
+  // Retire the micro-batches still in the slots, in order
+  for (int i = std::max(batches - depth, 0); i < batches; i++) {
+    int n0 = i*nb, slot = i % depth;
+    drained[slot].wait_and_throw();
+    retire(n0, std::min(nb, batch - n0), slot);
+  }
+  q.wait_and_throw();
+  compute_end();
+}
+
+// Geometry of a level of data cache of the core: size in bytes, ways and
+// line size.
+struct cache_level_t {
+  size_t size;
+  int ways, line;
+
+  size_t sets() const { return size / ((size_t)ways * line); }
+};
+
+// Reads the geometry of the data or unified cache of a level, 1 to 3, from
+// sysfs or, failing that, from cpuid leaf 4. The size is 0 if there is no
+// such level.
+inline cache_level_t read_cache_level(int level) {
+
+  for (int i = 0; i < 16; i++) {
+    std::string dir = "/sys/devices/system/cpu/cpu0/cache/index" 
+                    + std::to_string(i) + "/";
+    std::ifstream level_file(dir + "level"), type_file(dir + "type");
+    std::ifstream size_file(dir + "size"), line_file(dir + "coherency_line_size");
+    std::ifstream ways_file(dir + "ways_of_associativity");
+
+    int index_level; 
+    std::string type;
+    if (!(level_file >> index_level) || !(type_file >> type)) break;
+    if (index_level != level || type == "Instruction") continue;
+
+    size_t size = 0;
+    char unit = ' ';
+    cache_level_t cache = { 0, 0, 64 };
+    size_file >> size >> unit; // e.g. 32K
+    ways_file >> cache.ways;
+    line_file >> cache.line;
+    cache.size = size << (unit == 'K' ? 10 : unit == 'M' ? 20 : 0);
+    cache.ways = std::max(cache.ways, 1); // 0 if fully associative
+    if (cache.size) return cache;
+  }
+
+  #if defined(__x86_64__) && !defined(__SYCL_DEVICE_ONLY__)
+  unsigned eax, ebx, ecx, edx;
+  for (unsigned i = 0; __get_cpuid_count(4, i, &eax, &ebx, &ecx, &edx); i++) {
+    unsigned type = eax & 0x1f, index_level = (eax >> 5) & 0x7;
+    if (type == 0) break;
+    if (index_level != (unsigned)level || type == 2) continue; // instruction
+
+    cache_level_t cache;
+    cache.ways = ((ebx >> 22) & 0x3ff) + 1;
+    cache.line = (ebx & 0xfff) + 1;
+    int partitions = ((ebx >> 12) & 0x3ff) + 1;
+    cache.size = (size_t)cache.ways * partitions * cache.line * (ecx + 1);
+    return cache;
+  }
+  #endif
+
+  return { 0, 1, 64 };
+}
+
+// Returns the geometry of a level of data cache, read on the first call.
+inline const cache_level_t &cache_level(int level) {
+  static const cache_level_t levels[] = {
+    read_cache_level(1), read_cache_level(2), read_cache_level(3)
+  };
+  return levels[level-1];
+}
+
+// Removes a flag only understood by one executable from the arguments and
+// returns whether it was given.
+inline bool parse_flag(int &argc, char **argv, const std::string &flag) {
+
+  bool found = false;
+  int positional = 1;
+
+  for (int i = 1; i < argc; i++) {
+    if (argv[i] == flag) found = true;
+    else argv[positional++] = argv[i];
+  }
+
+  argc = positional;
+  return found;
+}
+
+// Hardware counters of the CPU engines, with -DPERF. They use the tensor 
+// constants and the caches above.
+#include "perf.hpp"
+
+// NUMA placement of the CPU engines, with --numa.
+#include "numa.hpp"
+
 // Multiplies the dimensions to get the total size of the memory object.
 inline dnnl::memory::dim product(const dnnl::memory::dims &dims) {
   return std::accumulate(dims.begin(), dims.end(), (dnnl::memory::dim)1,
@@ -178,6 +885,7 @@ inline void read_from_dnnl_memory(void *handle, dnnl::memory &mem) {
   dnnl::engine eng = mem.get_engine();
   size_t size = mem.get_desc().get_size();
   if (!handle) throw std::runtime_error("handle is nullptr.");
+  if (handle == mem.get_data_handle()) return; // bound with make_dnnl_memory
 
   #ifdef DNNL_WITH_SYCL
     bool is_cpu_sycl = (DNNL_CPU_RUNTIME == DNNL_RUNTIME_SYCL
@@ -192,16 +900,14 @@ inline void read_from_dnnl_memory(void *handle, dnnl::memory &mem) {
         uint8_t *src_ptr = src.get_pointer();
         if (!src_ptr)
           throw std::runtime_error("get_pointer returned nullptr.");
-        for (size_t i = 0; i < size; ++i)
-          ((uint8_t *)handle)[i] = src_ptr[i];
+        std::memcpy(handle, src_ptr, size);
       } else {
         assert(mkind == dnnl::sycl_interop::memory_kind::usm);
         uint8_t *src_ptr = (uint8_t *)mem.get_data_handle();
         if (!src_ptr)
           throw std::runtime_error("get_data_handle returned nullptr.");
         if (is_cpu_sycl) {
-          for (size_t i = 0; i < size; ++i)
-            ((uint8_t *)handle)[i] = src_ptr[i];
+          std::memcpy(handle, src_ptr, size);
         } else {
           auto sycl_queue = dnnl::sycl_interop::get_queue(dnnl::stream(eng));
           sycl_queue.memcpy(handle, src_ptr, size).wait();
@@ -228,8 +934,7 @@ inline void read_from_dnnl_memory(void *handle, dnnl::memory &mem) {
   if (eng.get_kind() == dnnl::engine::kind::cpu) {
     uint8_t *src = static_cast<uint8_t *>(mem.get_data_handle());
     if (!src) throw std::runtime_error("get_data_handle returned nullptr.");
-      for (size_t i = 0; i < size; ++i)
-        ((uint8_t *)handle)[i] = src[i];
+    std::memcpy(handle, src, size);
     return;
   }
 
@@ -242,6 +947,7 @@ inline void write_to_dnnl_memory(void *handle, dnnl::memory &mem) {
   dnnl::engine eng = mem.get_engine();
   size_t size = mem.get_desc().get_size();
   if (!handle) throw std::runtime_error("handle is nullptr.");
+  if (handle == mem.get_data_handle()) return; // bound with make_dnnl_memory
 
   #ifdef DNNL_WITH_SYCL
     bool is_cpu_sycl = (DNNL_CPU_RUNTIME == DNNL_RUNTIME_SYCL
@@ -256,16 +962,14 @@ inline void write_to_dnnl_memory(void *handle, dnnl::memory &mem) {
         uint8_t *dst_ptr = dst.get_pointer();
         if (!dst_ptr)
           throw std::runtime_error("get_pointer returned nullptr.");
-        for (size_t i = 0; i < size; ++i)
-          dst_ptr[i] = ((uint8_t *)handle)[i];
+        std::memcpy(dst_ptr, handle, size);
       } else {
         assert(mkind == dnnl::sycl_interop::memory_kind::usm);
         uint8_t *dst_ptr = (uint8_t *)mem.get_data_handle();
         if (!dst_ptr)
           throw std::runtime_error("get_data_handle returned nullptr.");
         if (is_cpu_sycl) {
-          for (size_t i = 0; i < size; ++i)
-            dst_ptr[i] = ((uint8_t *)handle)[i];
+          std::memcpy(dst_ptr, handle, size);
         } else {
           auto sycl_queue = dnnl::sycl_interop::get_queue(dnnl::stream(eng));
           sycl_queue.memcpy(dst_ptr, handle, size).wait();
@@ -292,35 +996,419 @@ inline void write_to_dnnl_memory(void *handle, dnnl::memory &mem) {
   if (eng.get_kind() == dnnl::engine::kind::cpu) {
     uint8_t *dst = static_cast<uint8_t *>(mem.get_data_handle());
     if (!dst) throw std::runtime_error("get_data_handle returned nullptr.");
-    for (size_t i = 0; i < size; ++i)
-      dst[i] = ((uint8_t *)handle)[i];
+    std::memcpy(dst, handle, size);
     return;
   }
 
   assert(!"not expected");
 }
 
-// Initializes three vectors with synthetic values. Note: avoids the use 
-// of floating point values due to precision errors between devices.
-inline void init_data(std::vector<float> &a, 
-                      std::vector<float> &b, 
-                      std::vector<float> &c) {
+// Allocator of the tensors bound to oneDNN memory objects. With SYCL, the
+// tensors live in shared USM, that the host and the device access through 
+// the same pointer.
+#ifdef DNNL_WITH_SYCL
+  typedef sycl::usm_allocator<float, sycl::usm::alloc::shared> dnnl_allocator;
+#else
+  typedef std::allocator<float> dnnl_allocator;
+#endif
+
+// Returns true if the engine runs on the SYCL runtime.
+inline bool is_sycl_engine(const dnnl::engine &eng) {
+  return eng.get_kind() == dnnl::engine::kind::cpu
+    ? DNNL_CPU_RUNTIME == DNNL_RUNTIME_SYCL
+    : DNNL_GPU_RUNTIME == DNNL_RUNTIME_SYCL;
+}
+
+// Returns the allocator for the tensors used with the engine.
+inline dnnl_allocator make_dnnl_allocator(const dnnl::engine &eng) {
+  #ifdef DNNL_WITH_SYCL
+    if (is_sycl_engine(eng))
+      return dnnl_allocator(dnnl::sycl_interop::get_context(eng),
+                            dnnl::sycl_interop::get_device(eng));
+    return dnnl_allocator(sycl::queue(sycl::cpu_selector()));
+  #else
+    return dnnl_allocator();
+  #endif
+}
+
+// Creates a memory object that uses the data of handle in place. The data 
+// must come from make_dnnl_allocator() with the same engine. Engines that
+// cannot access host memory (OpenCL GPUs) get a copy instead.
+inline dnnl::memory make_dnnl_memory(const dnnl::memory::desc &desc,
+                                     const dnnl::engine &eng, void *handle) {
+  #ifdef DNNL_WITH_SYCL
+    if (is_sycl_engine(eng))
+      return dnnl::sycl_interop::make_memory(desc, eng,
+        dnnl::sycl_interop::memory_kind::usm, handle);
+  #endif
+
+  if (eng.get_kind() == dnnl::engine::kind::cpu)
+    return dnnl::memory(desc, eng, handle);
+
+  dnnl::memory mem(desc, eng);
+  write_to_dnnl_memory(handle, mem);
+  return mem;
+}
+
+// Memory layouts of the activations. The blocked layouts, nChw8c and
+// nChw16c, group the channels in blocks of 8 or 16 that are contiguous in
+// memory, so that SIMD kernels can load them as vectors. The last block is
+// padded with zeros when the channels are not a multiple of the block.
+enum class layout_t { nchw, nhwc, chwn, nChw8c, nChw16c };
+
+// Returns the string representation of the layout.
+inline const std::string layout_to_string(layout_t layout) {
+  switch (layout) {
+    case layout_t::nchw:    return "nchw";
+    case layout_t::nhwc:    return "nhwc";
+    case layout_t::chwn:    return "chwn";
+    case layout_t::nChw8c:  return "nChw8c";
+    case layout_t::nChw16c: return "nChw16c";
+  }
+  return "<unknown layout>";
+}
+
+// Describes an activation tensor: its logical dimensions and its layout.
+struct tensor_desc_t {
+  int n, c, h, w;
+  layout_t layout;
+
+  // Channels per block, 1 for the plain layouts.
+  int block() const {
+    if (layout == layout_t::nChw8c) return 8;
+    if (layout == layout_t::nChw16c) return 16;
+    return 1;
+  }
+
+  // Channels including the padding of the last block.
+  int padded_c() const {
+    return (c + block()-1) / block() * block();
+  }
+
+  // Number of elements to allocate.
+  size_t size() const {
+    return (size_t)n * padded_c() * h * w;
+  }
+
+  // Position of the element (in,ic,ih,iw) in memory.
+  size_t offset(int in, int ic, int ih, int iw) const {
+    switch (layout) {
+      case layout_t::nchw: return (((size_t)in*c + ic)*h + ih)*w + iw;
+      case layout_t::nhwc: return (((size_t)in*h + ih)*w + iw)*c + ic;
+      case layout_t::chwn: return (((size_t)ic*h + ih)*w + iw)*n + in;
+      default: {
+        int b = block();
+        return ((((size_t)in*padded_c()/b + ic/b)*h + ih)*w + iw)*b + ic%b;
+      }
+    }
+  }
+};
+
+#if defined(__x86_64__) && !defined(__SYCL_DEVICE_ONLY__)
+
+// Transposes an 8×8 tile in ymm registers.
+__attribute__((target("avx")))
+inline void transpose_8x8(const float *src, size_t ld_src,
+                          float *dst, size_t ld_dst) {
+  __m256 r[8], t[8];
+  for (int i = 0; i < 8; i++) r[i] = _mm256_loadu_ps(&src[i*ld_src]);
+
+  for (int i = 0; i < 8; i += 2) {
+    t[i]   = _mm256_unpacklo_ps(r[i], r[i+1]);
+    t[i+1] = _mm256_unpackhi_ps(r[i], r[i+1]);
+  }
+  for (int i = 0; i < 8; i += 4) {
+    r[i]   = _mm256_shuffle_ps(t[i],   t[i+2], _MM_SHUFFLE(1,0,1,0));
+    r[i+1] = _mm256_shuffle_ps(t[i],   t[i+2], _MM_SHUFFLE(3,2,3,2));
+    r[i+2] = _mm256_shuffle_ps(t[i+1], t[i+3], _MM_SHUFFLE(1,0,1,0));
+    r[i+3] = _mm256_shuffle_ps(t[i+1], t[i+3], _MM_SHUFFLE(3,2,3,2));
+  }
+  for (int i = 0; i < 4; i++) {
+    t[i]   = _mm256_permute2f128_ps(r[i], r[i+4], 0x20);
+    t[i+4] = _mm256_permute2f128_ps(r[i], r[i+4], 0x31);
+  }
+
+  for (int i = 0; i < 8; i++) _mm256_storeu_ps(&dst[i*ld_dst], t[i]);
+}
+
+#endif
+
+// Transposes a rows×cols matrix, dst[j][i] = src[i][j], in 8×8 tiles so
+// that both sides stay in cache. Full tiles are transposed in registers
+// when the CPU has AVX.
+inline void transpose(const float *src, size_t ld_src, float *dst,
+                      size_t ld_dst, size_t rows, size_t cols) {
+
+  #if defined(__x86_64__) && !defined(__SYCL_DEVICE_ONLY__)
+    static const bool avx = __builtin_cpu_supports("avx");
+  #endif
+
+  for (size_t i0 = 0; i0 < rows; i0 += 8) {
+    for (size_t j0 = 0; j0 < cols; j0 += 8) {
+
+      #if defined(__x86_64__) && !defined(__SYCL_DEVICE_ONLY__)
+        if (avx && i0+8 <= rows && j0+8 <= cols) {
+          transpose_8x8(&src[i0*ld_src + j0], ld_src,
+                        &dst[j0*ld_dst + i0], ld_dst);
+          continue;
+        }
+      #endif
+
+      for (size_t i = i0; i < std::min(i0+8, rows); i++)
+        for (size_t j = j0; j < std::min(j0+8, cols); j++)
+          dst[j*ld_dst + i] = src[i*ld_src + j];
+    }
+  }
+}
+
+// Copies the tensor src into dst changing its layout. Every reorder from or
+// to nchw is a batch of transpositions; the rest go through nchw.
+inline void reorder_tensor(const float *src, const tensor_desc_t &src_desc,
+                           float *dst, const tensor_desc_t &dst_desc) {
+
+  const tensor_desc_t &s = src_desc, &d = dst_desc;
+  if (s.n != d.n || s.c != d.c || s.h != d.h || s.w != d.w)
+    throw std::runtime_error("reorder between tensors of different size");
+
+  size_t n = s.n, c = s.c, hw = (size_t)s.h*s.w;
+
+  if (s.layout == d.layout) {
+    std::copy(src, src + s.size(), dst);
+
+  } else if (s.layout != layout_t::nchw && d.layout != layout_t::nchw) {
+    tensor_desc_t tmp_desc = { s.n, s.c, s.h, s.w, layout_t::nchw };
+    std::vector<float> tmp(tmp_desc.size());
+    reorder_tensor(src, s, tmp.data(), tmp_desc);
+    reorder_tensor(tmp.data(), tmp_desc, dst, d);
+
+  } else if (d.layout == layout_t::nhwc) { // C×HW to HW×C per image
+    for (size_t i = 0; i < n; i++)
+      transpose(&src[i*c*hw], hw, &dst[i*hw*c], c, c, hw);
+
+  } else if (s.layout == layout_t::nhwc) { // HW×C to C×HW per image
+    for (size_t i = 0; i < n; i++)
+      transpose(&src[i*hw*c], c, &dst[i*c*hw], hw, hw, c);
+
+  } else if (d.layout == layout_t::chwn) { // N×CHW to CHW×N
+    transpose(src, c*hw, dst, n, n, c*hw);
+
+  } else if (s.layout == layout_t::chwn) { // CHW×N to N×CHW
+    transpose(src, n, dst, c*hw, c*hw, n);
+
+  } else if (d.block() > 1) { // b×HW to HW×b per block of channels
+    size_t b = d.block(), blocks = d.padded_c() / b;
+    for (size_t i = 0; i < n; i++) {
+      for (size_t cb = 0; cb < blocks; cb++) {
+        size_t valid = std::min(b, c - cb*b);
+        float *block = &dst[(i*blocks + cb)*hw*b];
+        transpose(&src[(i*c + cb*b)*hw], hw, block, b, valid, hw);
+        for (size_t j = 0; j < hw && valid < b; j++)
+          std::fill(&block[j*b + valid], &block[(j+1)*b], 0.f);
+      }
+    }
+
+  } else { // HW×b to b×HW per block of channels
+    size_t b = s.block(), blocks = s.padded_c() / b;
+    for (size_t i = 0; i < n; i++) {
+      for (size_t cb = 0; cb < blocks; cb++) {
+        size_t valid = std::min(b, c - cb*b);
+        transpose(&src[(i*blocks + cb)*hw*b], b,
+                  &dst[(i*c + cb*b)*hw], hw, hw, valid);
+      }
+    }
+  }
+}
+
+// Returns the layout of the activations of a tensor file.
+inline tensor_desc_t file_desc(const tensor_file_t &file) {
+  const uint64_t *d = file.header.dims;
+  return { (int)d[0], (int)d[1], (int)d[2], (int)d[3], 
+           (layout_t)file.header.layout };
+}
+
+// Checks that the dimensions in the header of a tensor file are positive,
+// fit in an int and that their product does not overflow.
+inline void check_dims(const tensor_file_t &file, const std::string &path) {
+  uint64_t elements = 1;
+  for (uint64_t d : file.header.dims) {
+    if (d == 0 || d > INT_MAX || __builtin_mul_overflow(elements, d, &elements))
+      throw std::runtime_error("the dimensions of " + path + 
+                               " are out of range");
+  }
+}
+
+// Maps the files of --input and --filters, whose dimensions replace the 
+// ones of the command line, checks them, and creates the file of --output
+// for the result, in nchw.
+inline void open_tensor_files() {
+
+  int n = N, c = C, k = K, h = H, w = W, r = R, s = S;
+
+  if (!input_path.empty()) {
+    input_file.open(input_path);
+    check_dims(input_file, input_path);
+    tensor_desc_t desc = file_desc(input_file);
+    if (input_file.header.layout > (uint32_t)layout_t::nChw16c || 
+        desc.size() != input_file.size())
+      throw std::runtime_error("the layout of " + input_path + " is invalid");
+    n = desc.n; c = desc.c; h = desc.h; w = desc.w;
+  }
+
+  if (!filters_path.empty()) {
+    filters_file.open(filters_path);
+    check_dims(filters_file, filters_path);
+    const uint64_t *d = filters_file.header.dims;
+    if (filters_file.header.layout != (uint32_t)layout_t::nchw ||
+        d[0]*d[1]*d[2]*d[3] != filters_file.size())
+      throw std::runtime_error("the filters of " + filters_path + 
+                               " are not K×C×R×S");
+    if (input_file && (int)d[1] != c)
+      throw std::runtime_error("the channels of " + filters_path + 
+                               " and " + input_path + " differ");
+    k = d[0]; c = d[1]; r = d[2]; s = d[3];
+  }
+
+  bool files = input_file || filters_file || !output_path.empty();
+  if (files && (h < r || w < s))
+    throw std::runtime_error("the filters are larger than the images");
+
+  set_dimensions(n, c, k, h, w, r, s);
+
+  if (!output_path.empty()) {
+    output_file.create(output_path, { (uint64_t)N, (uint64_t)K, 
+                                      (uint64_t)P, (uint64_t)Q }, 
+                       (uint32_t)layout_t::nchw, (size_t)N*K*P*Q);
+  }
+}
+
+// Whether the tensor of a file has the dimensions d0×d1×d2×d3, those of 
+// the current convolution, so that it can replace the synthetic tensor.
+inline bool file_matches(const tensor_file_t &file, 
+                         int d0, int d1, int d2, int d3) {
+  const uint64_t *d = file.header.dims;
+  return file && d[0] == (uint64_t)d0 && d[1] == (uint64_t)d1 && 
+                 d[2] == (uint64_t)d2 && d[3] == (uint64_t)d3;
+}
+
+// Whether an engine can read or write the tensor of a file in place, in 
+// its mapping, instead of in a vector: if it matches the current dimensions
+// and is in nchw. The engines that do give it an empty vector.
+inline bool in_place(const tensor_file_t &file, 
+                     int d0, int d1, int d2, int d3) {
+  return file_matches(file, d0, d1, d2, d3) && 
+         file.header.layout == (uint32_t)layout_t::nchw;
+}
+
+// Returns the host data of a tensor: the mapping of its file if the engine
+// uses it in place, with an empty vector, or the vector otherwise.
+template <class Allocator>
+inline float *host_data(const tensor_file_t &file, 
+                        std::vector<float, Allocator> &vec) {
+  return file && vec.empty() ? file.data() : vec.data();
+}
+
+// Advances the window of a file if the engine uses it in place, that is, 
+// if host is its mapping: see tensor_file_t::advance().
+inline void stream_file(tensor_file_t &file, const float *host, size_t first,
+                        size_t count, size_t behind) {
+  if (file && host == file.data()) file.advance(first, count, behind);
+}
+
+// Elements copied at a time between vectors and tensor files
+constexpr size_t FILE_CHUNK = (size_t)16 << 20;
+
+// Copies the tensor of a file to dst, in nchw, a chunk at a time so that 
+// only the chunk in use and the next one stay in memory.
+inline void read_tensor(tensor_file_t &file, float *dst) {
+
+  tensor_desc_t desc = file_desc(file);
+
+  if (desc.layout != layout_t::nchw) {
+    file.advance(0, file.size());
+    reorder_tensor(file.data(), desc, dst, 
+                   { desc.n, desc.c, desc.h, desc.w, layout_t::nchw });
+  } else {
+    for (size_t i = 0; i < file.size(); i += FILE_CHUNK) {
+      size_t count = std::min(FILE_CHUNK, file.size() - i);
+      file.advance(i, 2*FILE_CHUNK, FILE_CHUNK);
+      std::memcpy(&dst[i], &file.data()[i], count * sizeof(float));
+    }
+  }
+
+  file.advance(file.size(), 0); // drop the whole mapping
+}
+
+// Initializes three vectors with the tensors of the files, if given for 
+// the current dimensions and the vectors are for whole tensors, or else 
+// with synthetic values. Note: 
+// avoids the use of floating point values due to precision errors between
+// devices.
+template <class Allocator>
+inline void init_data(std::vector<float, Allocator> &a, 
+                      std::vector<float, Allocator> &b, 
+                      std::vector<float, Allocator> &c) {
   
-  for (int i = 0; i < a.size(); i++) a[i] = i % H;
-  for (int i = 0; i < b.size(); i++) b[i] = i % S;
+  if (file_matches(input_file, N, C, H, W) && a.size() == (size_t)N*C*H*W) {
+    read_tensor(input_file, a.data());
+  } else {
+    for (int i = 0; i < a.size(); i++) a[i] = i % H;
+  }
+
+  if (file_matches(filters_file, K, C, R, S) && 
+      b.size() == (size_t)K*C*R*S) {
+    read_tensor(filters_file, b.data());
+  } else {
+    for (int i = 0; i < b.size(); i++) b[i] = i % S;
+  }
+
   for (int i = 0; i < c.size(); i++) c[i] = 0;
 }
 
-// Perform convolution on host.
-std::vector<float> cpu_convolution() {
+// Writes the result, of count elements, to the file of --output, a chunk 
+// at a time, unless the engine wrote it there in place.
+inline void save_output(const float *y, size_t count) {
+
+  if (!output_file || y == output_file.data()) return;
+  if (count != output_file.size())
+    throw std::runtime_error("the output does not have the dimensions of " +
+                             output_path);
+
+  for (size_t i = 0; i < count; i += FILE_CHUNK) {
+    size_t chunk = std::min(FILE_CHUNK, count - i);
+    output_file.advance(i, FILE_CHUNK, FILE_CHUNK);
+    std::memcpy(&output_file.data()[i], &y[i], chunk * sizeof(float));
+  }
+}
+
+// Same as above, for a result in a vector.
+template <class Allocator>
+inline void save_output(const std::vector<float, Allocator> &y) {
+  save_output(y.data(), y.size());
+}
+
+// Initializes the bias and residual of the epilogue with synthetic values.
+// When the epilogue does not use them they get a single element, so that
+// the engines can always pass them to their kernels.
+template <class Allocator>
+inline void init_epilogue(std::vector<float, Allocator> &bias, 
+                          std::vector<float, Allocator> &residual) {
+
+  bias.assign(epilogue.has_bias ? K : 1, 0);
+  residual.assign(epilogue.has_residual ? N*K*P*Q : 1, 0);
+
+  if (epilogue.has_bias)
+    for (int i = 0; i < bias.size(); i++) bias[i] = i % 5 - 2;
+  if (epilogue.has_residual)
+    for (int i = 0; i < residual.size(); i++) residual[i] = i % 7 - 3;
+}
+
+// Perform convolution on host: y = x * f, followed by the epilogue.
+void cpu_convolution(const float *x, const float *f, float *y,
+                     const float *bias, const float *residual) {
   int n, c, k, h, w, r, s, p, q;
   int hw=H*W, rs=R*S, pq=P*Q, chw=C*H*W, crs=C*R*S, kpq=K*P*Q;
-  
-  std::vector<float> x(N*C*H*W);
-  std::vector<float> f(K*C*R*S);
-  std::vector<float> y(N*K*P*Q);
 
-  init_data(x, f, y);
+  PERF_REGION("cpu_convolution", 2.0*N*K*P*Q*C*R*S);
 
   for (n = 0; n < N; n++) {
     int n_chw = n * chw;
@@ -348,37 +1436,227 @@ std::vector<float> cpu_convolution() {
           }
         }
       }
+
+      if (epilogue.enabled()) {
+        for (int i = y_off; i < y_off + pq; i++) {
+          y[i] = epilogue.apply(y[i], bias, residual, k, i);
+        }
+      }
     }
   }
+}
+
+/**
+ * Result of the reference convolution: the expected output and, for every
+ * element, the sum of the magnitudes of the terms added to get it, 
+ * Σ|x·f| + |bias| + |residual|, to which the error of a float sum of those
+ * terms is proportional, whatever their signs.
+ */
+struct reference_t {
+  std::vector<float> y, magnitude;
+};
 
-  return y;
+/**
+ * Reference convolution on host: y = x * f, followed by the epilogue, 
+ * accumulated in double precision and rounded once to float, along with the
+ * magnitude of every output. Every thread takes tiles of up to 4 output 
+ * channels and PB rows of an image, whose accumulators fill half of L2, and
+ * for every channel of x converts the PB+R-1 rows that the tile reads, and
+ * their absolute values, to double once, then adds each of them to the rows
+ * of the tile that it contributes to.
+ */
+reference_t reference_convolution(const std::vector<float> &x, 
+                                  const std::vector<float> &f,
+                                  const std::vector<float> &bias,
+                                  const std::vector<float> &residual) {
+
+  PERF_REGION("reference_convolution", 2.0*N*K*P*Q*C*R*S);
+
+  reference_t ref;
+  ref.y.resize((size_t)N*K*P*Q);
+  ref.magnitude.resize((size_t)N*K*P*Q);
+
+  const int KB = std::min(K, 4);
+  size_t L2 = cache_level(2).size ? cache_level(2).size : 256 << 10;
+  const int PB = std::clamp<long>(L2 / 4 / (KB * Q * sizeof(double)), 1, P);
+  const int k_tiles = (K+KB-1)/KB, p_tiles = (P+PB-1)/PB;
+  const size_t tiles = (size_t)N * k_tiles * p_tiles;
+  std::atomic<size_t> next_tile(0);
+
+  auto worker = [&]() {
+    std::vector<double> acc((size_t)KB*PB*Q), rows((size_t)(PB+R-1)*W);
+    std::vector<double> abs_acc(acc.size()), abs_rows(rows.size());
+
+    for (size_t t; (t = next_tile++) < tiles; ) {
+      int n = t / (k_tiles*p_tiles);
+      int k0 = t / p_tiles % k_tiles * KB, kb = std::min(KB, K - k0);
+      int p0 = t % p_tiles * PB, pb = std::min(PB, P - p0);
+      std::fill(acc.begin(), acc.end(), 0.0);
+      std::fill(abs_acc.begin(), abs_acc.end(), 0.0);
+
+      for (int c = 0; c < C; c++) {
+        const float *x_rows = &x[(((size_t)n*C + c)*H + p0)*W];
+        size_t count = (size_t)(pb+R-1)*W;
+        std::copy(x_rows, x_rows + count, rows.begin());
+        for (size_t i = 0; i < count; i++) abs_rows[i] = std::fabs(rows[i]);
+
+        for (int r = 0; r < R; r++) {
+          for (int p = 0; p < pb; p++) {
+            const double *x_row = &rows[(size_t)(p+r)*W];
+            const double *abs_x_row = &abs_rows[(size_t)(p+r)*W];
+
+            for (int k = 0; k < kb; k++) {
+              double *acc_row = &acc[((size_t)k*PB + p)*Q];
+              double *abs_acc_row = &abs_acc[((size_t)k*PB + p)*Q];
+              const float *f_row = &f[(((size_t)k0+k)*C + c)*R*S + r*S];
+
+              for (int s = 0; s < S; s++) {
+                double weight = f_row[s], abs_weight = std::fabs(weight);
+                for (int q = 0; q < Q; q++) {
+                  acc_row[q] += weight * x_row[q+s];
+                  abs_acc_row[q] += abs_weight * abs_x_row[q+s];
+                }
+              }
+            }
+          }
+        }
+      }
+
+      for (int k = 0; k < kb; k++) {
+        size_t y_off = (((size_t)n*K + k0+k)*P + p0)*Q;
+        for (size_t i = 0; i < (size_t)pb*Q; i++) {
+          double v = acc[(size_t)k*PB*Q + i];
+          double magnitude = abs_acc[(size_t)k*PB*Q + i];
+          if (epilogue.enabled()) {
+            v = epilogue.apply(v, bias, residual, k0+k, y_off + i);
+            if (epilogue.has_bias) magnitude += std::fabs(bias[k0+k]);
+            if (epilogue.has_residual) 
+              magnitude += std::fabs(residual[y_off + i]);
+          }
+          ref.y[y_off + i] = v;
+          ref.magnitude[y_off + i] = magnitude;
+        }
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  int workers = std::max(1u, std::thread::hardware_concurrency());
+  for (int i = 1; i < workers; i++) threads.emplace_back(worker);
+  worker();
+  for (auto &thread : threads) thread.join();
+
+  return ref;
 }
 
-// Return true if both params have the same value.
-bool equals(float a, float b) {
-  return fabs(a - b) < std::numeric_limits<float>::epsilon();
+// Perform the reference convolution on host with the synthetic tensors.
+reference_t cpu_convolution() {
+  std::vector<float> x((size_t)N*C*H*W);
+  std::vector<float> f((size_t)K*C*R*S);
+  std::vector<float> y;
+
+  std::vector<float> bias, residual;
+
+  init_data(x, f, y);
+  init_epilogue(bias, residual);
+
+  return reference_convolution(x, f, bias, residual);
 }
 
-// Compare host side results with the result buffer from device side: print
-// mismatched data 4 times only. 
-void compare(std::vector<float> expected, std::vector<float> result) {
+// Returns the error of a result in units in the last place of float at the
+// expected value, or at 1 for the values smaller than 1.
+inline double ulp_error(float expected, float result) {
+  double scale = std::max(1.f, std::fabs(expected));
+  double ulp = std::nextafter((float)scale, INFINITY) - scale;
+  return std::fabs((double)expected - result) / ulp;
+}
+
+/**
+ * Compares the result of an engine with the expected one, element by 
+ * element. An element fails beyond the error bound of a float sum of its
+ * C·R·S products, in any order and whatever their signs, C·R·S·ε·Σ|terms|
+ * (see reference_t), or beyond a tolerance relative to Σ|terms| instead,
+ * that the algorithms that change the rounding of the result, like 
+ * Winograd, can pass; both are added the rounding of the expected value. 
+ * Prints the first 4 mismatches and a histogram of the errors in ULPs (see
+ * ulp_error()), in powers of two, with the largest fraction of the bound.
+ */
+void compare(const reference_t &expected, const float *result, 
+             float tolerance = 0) {
   
+  double epsilon = std::numeric_limits<float>::epsilon();
+  double factor = tolerance ? tolerance : std::max(C*R*S, 1) * epsilon;
+  double max_error = 0, max_ratio = 0;
+  size_t histogram[34] = {}; // 0, ≤1, ≤2, ≤4, ..., larger
   int printed_errors = 0;
 
-  for (int i = 0; i < expected.size(); i++) {
-    if (!equals(expected[i], result[i])) {
+  for (size_t i = 0; i < expected.y.size(); i++) {
+    float e = expected.y[i];
+    double error = ulp_error(e, result[i]);
+    if (std::isnan(error)) error = INFINITY;
+    max_error = std::max(max_error, error);
+    histogram[error ? std::max(1, (int)std::min(33.0, 
+                                 std::ceil(std::log2(error)) + 1)) : 0]++;
+
+    double bound = factor * expected.magnitude[i] + 
+                   (std::nextafter(std::fabs(e), INFINITY) - std::fabs(e));
+    double ratio = std::fabs((double)e - result[i]) / bound;
+    if (std::isnan(ratio)) ratio = INFINITY;
+    max_ratio = std::max(max_ratio, ratio);
+
+    if (ratio > 1 && printed_errors < 4) {
       std::cout << "\nFail - The result is incorrect for element: y(" 
-           << i/(K*P*Q) << "·" << i/(P*Q) << "·" << i/Q << "·" << i%Q 
-           << "), expected: " << expected[i] << ", but found: " << result[i];
-      if (++printed_errors == 4) break;
+           << i/(K*P*Q) << "·" << i/(P*Q)%K << "·" << i/Q%P << "·" << i%Q 
+           << "), expected: " << e << ", but found: " << result[i]
+           << " (" << error << " ulp, bound " << bound << ")";
+      printed_errors++;
     }
   }
 
-  if (printed_errors) {
-    std::cout << "\nFail - The results mismatch!\n";
+  if (max_ratio > 1) {
+    std::cout << "\nFail - The results mismatch!";
   } else {
-    std::cout << ": Success - The results are correct!\n";
+    std::cout << ": Success - The results are correct!";
   }
+
+  std::cout << " Error (ulp):";
+  for (int b = 0; b < 34; b++) {
+    if (!histogram[b]) continue;
+    if (b == 0) std::cout << " 0";
+    else if (b < 33) std::cout << " <=" << (1u << (b-1));
+    else std::cout << " >" << (1u << 31);
+    std::cout << " x" << histogram[b] << ",";
+  }
+  std::cout << " max " << max_error << ", max/bound " << max_ratio << "\n";
+}
+
+// Same as above, for a result in a vector.
+template <class Allocator>
+void compare(const reference_t &expected, 
+             const std::vector<float, Allocator> &result, float tolerance = 0) {
+  compare(expected, result.data(), tolerance);
+}
+
+// Prints the error of a result in reduced precision against the f32 one:
+// the maximum and mean absolute errors, and the maximum relative to the 
+// largest output, which is comparable across shapes.
+template <class Allocator>
+void error_stats(const reference_t &expected, 
+                 const std::vector<float, Allocator> &result) {
+
+  double max_error = 0, sum_error = 0, max_value = 0;
+
+  for (int i = 0; i < expected.y.size(); i++) {
+    double error = fabs(expected.y[i] - result[i]);
+    max_error = std::max(max_error, error);
+    sum_error += error;
+    max_value = std::max(max_value, (double)fabs(expected.y[i]));
+  }
+
+  std::cout << ": max abs error " << max_error
+            << ", mean abs error " << sum_error / expected.y.size()
+            << ", max error relative to max |y| " 
+            << (max_value ? max_error / max_value : 0) << "\n";
 }
 
 #endif
@@ -0,0 +1,80 @@
+/**
+ * winograd.hpp
+ *
+ * Tile sizes and transformation matrices of the Winograd convolution
+ * F(m×m,3×3), shared by the sequential and the parallel engines. Compile 
+ * with -DWINOGRAD_M=2 or -DWINOGRAD_M=4 to choose the output tile size.
+ *
+ * Lavin & Gray, Fast Algorithms for Convolutional Neural Networks (2015).
+ *
+ * It has no include guard: bench includes both engines of each tile size,
+ * each one in its own namespace, and every namespace needs the matrices.
+ */
+
+#ifndef WINOGRAD_M
+  #define WINOGRAD_M 2
+#endif
+
+constexpr int TILE = WINOGRAD_M;  // output tile size
+constexpr int ALPHA = TILE + 2;   // input tile size
+
+/**
+ * Transformation matrices: Y = Aᵀ·[(G·g·Gᵀ) ⊙ (Bᵀ·d·B)]·A
+ */
+#if WINOGRAD_M == 2
+constexpr float BT[ALPHA][ALPHA] = {
+  { 1,  0, -1,  0 },
+  { 0,  1,  1,  0 },
+  { 0, -1,  1,  0 },
+  { 0,  1,  0, -1 }
+};
+constexpr float G[ALPHA][3] = {
+  { 1,    0,    0   },
+  { 0.5,  0.5,  0.5 },
+  { 0.5, -0.5,  0.5 },
+  { 0,    0,    1   }
+};
+constexpr float AT[TILE][ALPHA] = {
+  { 1,  1,  1,  0 },
+  { 0,  1, -1, -1 }
+};
+#elif WINOGRAD_M == 4
+constexpr float BT[ALPHA][ALPHA] = {
+  { 4,  0, -5,  0,  1,  0 },
+  { 0, -4, -4,  1,  1,  0 },
+  { 0,  4, -4, -1,  1,  0 },
+  { 0, -2, -1,  2,  1,  0 },
+  { 0,  2, -1, -2,  1,  0 },
+  { 0,  4,  0, -5,  0,  1 }
+};
+constexpr float G[ALPHA][3] = {
+  {  1.f/4,   0,       0      },
+  { -1.f/6,  -1.f/6,  -1.f/6  },
+  { -1.f/6,   1.f/6,  -1.f/6  },
+  {  1.f/24,  1.f/12,  1.f/6  },
+  {  1.f/24, -1.f/12,  1.f/6  },
+  {  0,       0,       1      }
+};
+constexpr float AT[TILE][ALPHA] = {
+  { 1,  1,  1,  1,  1,  0 },
+  { 0,  1, -1,  2, -2,  0 },
+  { 0,  1,  1,  4,  4,  0 },
+  { 0,  1, -1,  8, -8,  1 }
+};
+#else
+  #error "WINOGRAD_M must be 2 or 4"
+#endif
+
+//    Copyright 2021 Sara Aguado Couselo
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
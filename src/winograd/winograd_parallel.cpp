@@ -0,0 +1,281 @@
+/**
+ * winograd_parallel.cpp
+ *
+ * Implements the Winograd convolution algorithm F(m×m,3×3) in forward
+ * propagation mode. Compile with -DWINOGRAD_M=2 or -DWINOGRAD_M=4 to choose
+ * the output tile size.
+ *
+ * Lavin & Gray, Fast Algorithms for Convolutional Neural Networks (2015).
+ */
+
+#include "../utils.hpp"
+#include "dpc_common.hpp"
+#include "winograd.hpp"
+
+/**
+ * Struct to pass the dimensions to the kernel
+ */
+struct constants_t {
+  int N,C,K,H,W,P,Q; // tensor constants
+  int TW,T; // tiles: width-wise and per image
+};
+
+/**
+ * Tile of the batch whose transformed inputs and products are in the 
+ * workspace: nb images from n0.
+ */
+struct tile_t {
+  int n0, nb;
+};
+
+/**
+ * Chooses the images per tile so that the transformed inputs and products
+ * of a tile fit in the workspace budget, with the transformed filters. 
+ * Fails if not even one image fits.
+ */
+int tile_size(int T) {
+
+  size_t filter_bytes = (size_t)ALPHA*ALPHA*K*C*sizeof(float);
+  size_t image_bytes = (size_t)ALPHA*ALPHA*(C+K)*T*sizeof(float);
+  size_t budget = workspace_budget ? workspace_budget : SIZE_MAX;
+
+  if (budget < filter_bytes + image_bytes) {
+    size_t needed = (filter_bytes + image_bytes + ((size_t)1 << 20)-1) >> 20;
+    throw std::runtime_error("the transforms of an image need a "
+                             "workspace of " + std::to_string(needed) + " MB");
+  }
+
+  return std::min<size_t>(N, (budget - filter_bytes) / image_bytes);
+}
+
+/**
+ * Filter transform once, then input transform + batched matrix 
+ * multiplication + output transform for every tile of the batch, each one 
+ * in its own kernel.
+ */
+void convolution(dnnl::engine::kind engine_kind) {
+
+  if (R != 3 || S != 3)
+    throw std::runtime_error("Winograd F(m×m,3×3) needs 3×3 filters");
+
+  int TH = (P + TILE-1) / TILE;
+  int TW = (Q + TILE-1) / TILE;
+  int T = TH * TW;
+  int nb = tile_size(T);
+
+  constants_t constants = { N,C,K,H,W,P,Q,TW,T };
+
+  std::vector<float> x_vec(N*C*H*W);
+  std::vector<float> f_vec(K*C*R*S);
+  std::vector<float> y_vec(N*K*P*Q);
+  std::vector<float> bias_vec, residual_vec;
+
+  init_data(x_vec, f_vec, y_vec);
+  init_epilogue(bias_vec, residual_vec);
+  epilogue_t epi = epilogue; // globals are not accessible from the kernel
+
+  {
+
+    // Initialize the device queue with the custom selector. The device queue is
+    // used to enqueue kernels. It encapsulates all states needed for execution.
+    sycl::queue device_queue(
+      select_device(engine_kind), dpc_common::exception_handler
+    );
+    
+    #ifdef DEBUG
+    std::cout << device_queue.get_device().get_info<sycl::info::device::name>();
+    #endif
+
+    // Create buffers for tensors, buffer c is bound with host memory y_vec
+    // Allocate DPC++ buffers for input and output memory objects
+    sycl::buffer x_buf(x_vec.data(), sycl::range(x_vec.size()));
+    sycl::buffer f_buf(f_vec.data(), sycl::range(f_vec.size()));
+    sycl::buffer y_buf(y_vec.data(), sycl::range(y_vec.size()));
+    sycl::buffer bias_buf(bias_vec.data(), sycl::range(bias_vec.size()));
+    sycl::buffer residual_buf(residual_vec.data(), 
+                              sycl::range(residual_vec.size()));
+    sycl::buffer args_buf(&constants, sycl::range(1));
+
+    // Transformed filters, and inputs and products of a tile of nb images,
+    // only used in the device
+    size_t U_size = (size_t)ALPHA*ALPHA*K*C;
+    size_t V_size = (size_t)ALPHA*ALPHA*C*nb*T;
+    size_t M_size = (size_t)ALPHA*ALPHA*K*nb*T;
+    sycl::buffer<float, 1> U_buf{sycl::range<1>(U_size)};
+    sycl::buffer<float, 1> V_buf{sycl::range<1>(V_size)};
+    sycl::buffer<float, 1> M_buf{sycl::range<1>(M_size)};
+    workspace_bytes = (U_size + V_size + M_size) * sizeof(float);
+
+    compute_begin();
+
+    // Submit command group to queue to transform the filters once: U = G·g·Gᵀ
+    device_queue.submit([&](sycl::handler &context) {
+
+      sycl::accessor f(f_buf, context, sycl::read_only);
+      sycl::accessor U(U_buf, context, sycl::write_only);
+      sycl::accessor args(args_buf, context, sycl::read_only);
+
+      context.parallel_for(sycl::range(K,C), [=](auto index) {
+
+        auto arg = args[0];
+        int k = index[0];
+        int c = index[1];
+        size_t f_off = ((size_t)k*arg.C + c)*9;
+        float Gg[ALPHA][3] = {};
+
+        for (int i = 0; i < ALPHA; i++)
+          for (int j = 0; j < 3; j++)
+            for (int l = 0; l < 3; l++)
+              Gg[i][j] += G[i][l] * f[f_off + l*3+j];
+
+        for (int i = 0; i < ALPHA; i++) {
+          for (int j = 0; j < ALPHA; j++) {
+            float u = 0;
+            for (int l = 0; l < 3; l++) u += Gg[i][l] * G[j][l];
+            U[(size_t)(i*ALPHA+j)*arg.K*arg.C + (size_t)k*arg.C + c] = u;
+          }
+        }
+      });
+    });
+
+    for (int n0 = 0; n0 < N; n0 += nb) {
+      tile_t tile = { n0, std::min(nb, N - n0) };
+
+      // Submit command group to queue to transform the input tiles of the
+      // images of the tile: V = Bᵀ·d·B
+      device_queue.submit([&](sycl::handler &context) {
+
+        sycl::accessor x(x_buf, context, sycl::read_only);
+        sycl::accessor V(V_buf, context, sycl::write_only);
+        sycl::accessor args(args_buf, context, sycl::read_only);
+
+        context.parallel_for(sycl::range(tile.nb,C,T), [=](auto index) {
+
+          auto arg = args[0];
+          int n = index[0];
+          int c = index[1];
+          int t = index[2];
+          int h0 = (t / arg.TW) * TILE;
+          int w0 = (t % arg.TW) * TILE;
+          size_t NT = (size_t)tile.nb*arg.T;
+          size_t x_off = ((size_t)(tile.n0 + n)*arg.C + c)*arg.H*arg.W;
+          float d[ALPHA][ALPHA], BTd[ALPHA][ALPHA] = {};
+
+          for (int i = 0; i < ALPHA; i++)
+            for (int j = 0; j < ALPHA; j++)
+              d[i][j] = (h0+i < arg.H && w0+j < arg.W) 
+                ? x[x_off + (size_t)(h0+i)*arg.W + w0+j] : 0;
+
+          for (int i = 0; i < ALPHA; i++)
+            for (int j = 0; j < ALPHA; j++)
+              for (int l = 0; l < ALPHA; l++)
+                BTd[i][j] += BT[i][l] * d[l][j];
+
+          for (int i = 0; i < ALPHA; i++) {
+            for (int j = 0; j < ALPHA; j++) {
+              float v = 0;
+              for (int l = 0; l < ALPHA; l++) v += BTd[i][l] * BT[j][l];
+              V[(i*ALPHA+j)*arg.C*NT + c*NT + (size_t)n*arg.T + t] = v;
+            }
+          }
+        });
+      });
+
+      // Submit command group to queue to perform the batched matmul over 
+      // the tiles of the images: M[xi] (K×NT) = U[xi] (K×C) · V[xi] (C×NT)
+      device_queue.submit([&](sycl::handler &context) {
+
+        sycl::accessor U(U_buf, context, sycl::read_only);
+        sycl::accessor V(V_buf, context, sycl::read_only);
+        sycl::accessor M(M_buf, context, sycl::write_only);
+        sycl::accessor args(args_buf, context, sycl::read_only);
+
+        context.parallel_for(sycl::range(ALPHA*ALPHA,K,tile.nb*T), 
+                             [=](auto index) {
+
+          auto arg = args[0];
+          int xi = index[0];
+          int k = index[1];
+          size_t j = index[2];
+          size_t NT = (size_t)tile.nb*arg.T;
+          size_t U_off = (size_t)xi*arg.K*arg.C + (size_t)k*arg.C;
+          size_t V_off = (size_t)xi*arg.C*NT + j;
+          float acc = 0;
+
+          for (int c = 0; c < arg.C; c++) {
+            acc += U[U_off + c] * V[V_off + c*NT];
+          }
+          M[(size_t)xi*arg.K*NT + k*NT + j] = acc;
+        });
+      });
+
+      // Submit command group to queue to transform the products back: 
+      // Aᵀ·m·A
+      device_queue.submit([&](sycl::handler &context) {
+
+        sycl::accessor M(M_buf, context, sycl::read_only);
+        sycl::accessor y(y_buf, context, sycl::write_only);
+        sycl::accessor bias(bias_buf, context, sycl::read_only);
+        sycl::accessor residual(residual_buf, context, sycl::read_only);
+        sycl::accessor args(args_buf, context, sycl::read_only);
+
+        context.parallel_for(sycl::range(tile.nb,K,T), [=](auto index) {
+
+          auto arg = args[0];
+          int n = index[0];
+          int k = index[1];
+          int t = index[2];
+          int p0 = (t / arg.TW) * TILE;
+          int q0 = (t % arg.TW) * TILE;
+          size_t NT = (size_t)tile.nb*arg.T;
+          size_t M_off = k*NT + (size_t)n*arg.T + t;
+          size_t y_off = ((size_t)(tile.n0 + n)*arg.K + k)*arg.P*arg.Q;
+          float ATm[TILE][ALPHA] = {};
+
+          for (int i = 0; i < TILE; i++)
+            for (int j = 0; j < ALPHA; j++)
+              for (int l = 0; l < ALPHA; l++)
+                ATm[i][j] += AT[i][l] * M[(l*ALPHA+j)*arg.K*NT + M_off];
+
+          for (int i = 0; i < TILE && p0+i < arg.P; i++) {
+            for (int j = 0; j < TILE && q0+j < arg.Q; j++) {
+              float v = 0;
+              for (int l = 0; l < ALPHA; l++) v += ATm[i][l] * AT[j][l];
+              size_t i_y = y_off + (size_t)(p0+i)*arg.Q + q0+j;
+              y[i_y] = epi.apply(v, bias, residual, k, i_y);
+            }
+          }
+        });
+      });
+    }
+    device_queue.wait_and_throw();
+
+    compute_end();
+
+  } // y_vec is updated when y_buf is destroyed upon exiting scope
+
+  save_output(y_vec);
+
+  #ifdef DEBUG // only run the sequential convolution if debugging
+  std::cout << ": workspace " << workspace_bytes / 1048576.0 << " MB";
+  compare(cpu_convolution(), y_vec, 1e-3); // transforms change the rounding
+  #endif
+}
+
+int main(int argc, char **argv) {
+  return handle_errors(parse_arguments(argc,argv), convolution);
+}
+
+//    Copyright 2021 Sara Aguado Couselo
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
@@ -0,0 +1,185 @@
+/**
+ * winograd_sequential.cpp
+ *
+ * Implements the Winograd convolution algorithm F(m×m,3×3) in forward
+ * propagation mode. Compile with -DWINOGRAD_M=2 or -DWINOGRAD_M=4 to choose
+ * the output tile size.
+ *
+ * Lavin & Gray, Fast Algorithms for Convolutional Neural Networks (2015).
+ */
+
+#include "../utils.hpp"
+#include "winograd.hpp"
+
+int TH, TW, T; // tiles per image: height-wise, width-wise and total
+
+/**
+ * Transforms the filters, U = G·g·Gᵀ, into ALPHA² matrices of K×C.
+ */
+void filter_transform(float *U, float *f) {
+
+  for (int k = 0; k < K; k++) {
+    for (int c = 0; c < C; c++) {
+      float *g = &f[k*C*9 + c*9];
+      float Gg[ALPHA][3] = {};
+
+      for (int i = 0; i < ALPHA; i++)
+        for (int j = 0; j < 3; j++)
+          for (int l = 0; l < 3; l++)
+            Gg[i][j] += G[i][l] * g[l*3+j];
+
+      for (int i = 0; i < ALPHA; i++) {
+        for (int j = 0; j < ALPHA; j++) {
+          float u = 0;
+          for (int l = 0; l < 3; l++) u += Gg[i][l] * G[j][l];
+          U[(i*ALPHA+j)*K*C + k*C + c] = u;
+        }
+      }
+    }
+  }
+}
+
+/**
+ * Transforms the input tiles of an image, V = Bᵀ·d·B, into ALPHA² matrices
+ * of C×T. Tiles overlap by two rows/columns and are zero-padded at the edges.
+ */
+void input_transform(float *V, float *x) {
+
+  for (int c = 0; c < C; c++) {
+    for (int t = 0; t < T; t++) {
+      int h0 = (t / TW) * TILE;
+      int w0 = (t % TW) * TILE;
+      float d[ALPHA][ALPHA], BTd[ALPHA][ALPHA] = {};
+
+      for (int i = 0; i < ALPHA; i++)
+        for (int j = 0; j < ALPHA; j++)
+          d[i][j] = (h0+i < H && w0+j < W) ? x[c*H*W + (h0+i)*W + w0+j] : 0;
+
+      for (int i = 0; i < ALPHA; i++)
+        for (int j = 0; j < ALPHA; j++)
+          for (int l = 0; l < ALPHA; l++)
+            BTd[i][j] += BT[i][l] * d[l][j];
+
+      for (int i = 0; i < ALPHA; i++) {
+        for (int j = 0; j < ALPHA; j++) {
+          float v = 0;
+          for (int l = 0; l < ALPHA; l++) v += BTd[i][l] * BT[j][l];
+          V[(i*ALPHA+j)*C*T + c*T + t] = v;
+        }
+      }
+    }
+  }
+}
+
+/**
+ * Performs the ALPHA² element-wise products of the transformed tiles,
+ * summed over the channels, as a batch of matrix multiplications:
+ * Y[xi] (K×T) = U[xi] (K×C) · V[xi] (C×T)
+ */
+void batched_matmul(float *Y, float *U, float *V) {
+
+  for (int xi = 0; xi < ALPHA*ALPHA; xi++) {
+    float *Yi = &Y[xi*K*T], *Ui = &U[xi*K*C], *Vi = &V[xi*C*T];
+
+    for (int k = 0; k < K; k++) {
+      for (int t = 0; t < T; t++) Yi[k*T+t] = 0;
+      for (int c = 0; c < C; c++) {
+        float u = Ui[k*C+c];
+        for (int t = 0; t < T; t++) {
+          Yi[k*T+t] += u * Vi[c*T+t];
+        }
+      }
+    }
+  }
+}
+
+/**
+ * Transforms the products back, Aᵀ·m·A, into the output tiles of an image,
+ * and applies the epilogue as they are stored. y_off is the position of y
+ * in the output tensor.
+ */
+void output_transform(float *y, float *Y, float *bias, float *residual,
+                      size_t y_off) {
+
+  for (int k = 0; k < K; k++) {
+    for (int t = 0; t < T; t++) {
+      int p0 = (t / TW) * TILE;
+      int q0 = (t % TW) * TILE;
+      float ATm[TILE][ALPHA] = {};
+
+      for (int i = 0; i < TILE; i++)
+        for (int j = 0; j < ALPHA; j++)
+          for (int l = 0; l < ALPHA; l++)
+            ATm[i][j] += AT[i][l] * Y[(l*ALPHA+j)*K*T + k*T + t];
+
+      for (int i = 0; i < TILE && p0+i < P; i++) {
+        for (int j = 0; j < TILE && q0+j < Q; j++) {
+          float v = 0;
+          for (int l = 0; l < ALPHA; l++) v += ATm[i][l] * AT[j][l];
+          int i_y = k*P*Q + (p0+i)*Q + q0+j;
+          y[i_y] = epilogue.apply(v, bias, residual, k, y_off + i_y);
+        }
+      }
+    }
+  }
+}
+
+/**
+ * Filter transform once, then input transform + batched matrix
+ * multiplication + output transform for every image of the batch.
+ */
+void convolution() {
+
+  if (R != 3 || S != 3)
+    throw std::runtime_error("Winograd F(m×m,3×3) needs 3×3 filters");
+
+  TH = (P + TILE-1) / TILE;
+  TW = (Q + TILE-1) / TILE;
+  T = TH * TW;
+
+  arena_vector_t<float> x_vec(N*C*H*W);
+  arena_vector_t<float> f_vec(K*C*R*S);
+  arena_vector_t<float> y_vec(N*K*P*Q);
+  std::vector<float> bias_vec, residual_vec;
+
+  init_data(x_vec, f_vec, y_vec);
+  init_epilogue(bias_vec, residual_vec);
+
+  arena_buffer_t<float> U((size_t)ALPHA*ALPHA*K*C);
+  arena_buffer_t<float> V((size_t)ALPHA*ALPHA*C*T);
+  arena_buffer_t<float> Y((size_t)ALPHA*ALPHA*K*T);
+
+  compute_begin();
+  filter_transform(U, f_vec.data());
+  for (int n = 0; n < N; n++) {
+    input_transform(V, &x_vec[n*C*H*W]);
+    batched_matmul(Y, U, V);
+    output_transform(&y_vec[n*K*P*Q], Y, bias_vec.data(), residual_vec.data(),
+                     (size_t)n*K*P*Q);
+  }
+  compute_end();
+
+  save_output(y_vec);
+
+  #ifdef DEBUG // only run the sequential convolution if debugging
+  compare(cpu_convolution(), y_vec, 1e-3); // transforms change the rounding
+  #endif
+}
+
+int main(int argc, char **argv) {
+  return handle_errors(parse_arguments(argc,argv), convolution);
+}
+
+//    Copyright 2021 Sara Aguado Couselo
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.